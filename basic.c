@@ -524,36 +524,32 @@ gotoline(int f, int n)
 }
 
 /*
- * Set the line number and switch to it.
+ * Set the line number and switch to it.  The line is looked up in the
+ * buffer's position index; the list is only walked if that fails.
  */
 int
 setlineno(int n)
 {
 	struct line  *clp;
+	int	      nlines;
 
-	if (n >= 0) {
-		if (n == 0)
-			n++;
-		curwp->w_dotline = n;
+	if ((nlines = lidxnlines(curbp)) <= 0) {
+		nlines = 0;
+		for (clp = bfirstlp(curbp); clp != curbp->b_headp;
+		    clp = lforw(clp))
+			nlines++;
+	}
+	if (n < 0)
+		n += nlines;
+	if (n > nlines)
+		n = nlines;
+	if (n < 1)
+		n = 1;
+	curwp->w_dotline = n;
+	if ((clp = lidxline(curbp, n)) == NULL) {
 		clp = lforw(curbp->b_headp);	/* "clp" is first line */
-		while (--n > 0) {
-			if (lforw(clp) == curbp->b_headp) {
-				curwp->w_dotline = curwp->w_bufp->b_lines;
-				break;
-			}
+		while (--n > 0)
 			clp = lforw(clp);
-		}
-	} else {
-		curwp->w_dotline = curwp->w_bufp->b_lines + n;
-		clp = lback(curbp->b_headp);	/* "clp" is last line */
-		while (n < 0) {
-			if (lback(clp) == curbp->b_headp) {
-				curwp->w_dotline = 1;
-				break;
-			}
-			clp = lback(clp);
-			n++;
-		}
 	}
 	curwp->w_dotp = clp;
 	curwp->w_doto = 0;
@@ -221,7 +221,6 @@ killbuffer(struct buffer *bp)
 	struct buffer *bp2;
 	struct mgwin  *wp;
 	int s;
-	struct undo_rec *rec;
 
 	/*
 	 * Find some other buffer to display. Try the alternate buffer,
@@ -270,10 +269,7 @@ killbuffer(struct buffer *bp)
 		bp1 = bp1->b_bufp;
 	}
 
-	while ((rec = TAILQ_FIRST(&bp->b_undo))) {
-		TAILQ_REMOVE(&bp->b_undo, rec, next);
-		free_undo_record(rec);
-	}
+	undo_clear(bp);
 
 	free(bp->b_bname);			/* Release name block	 */
 	free(bp);				/* Release buffer block */
@@ -375,8 +371,10 @@ makelist(void)
 
 	listbuf_ncol = ncol;		/* cache ncol for listbuf_goto_buffer */
 
-	if (addlinef(blp, "%-*s%s", w, " MR Buffer", "Size   File") == FALSE ||
-	    addlinef(blp, "%-*s%s", w, " -- ------", "----   ----") == FALSE)
+	if (addlinef(blp, "%-*s%s", w, " MR Buffer",
+	    "Size   Saved  File") == FALSE ||
+	    addlinef(blp, "%-*s%s", w, " -- ------",
+	    "----   -----  ----") == FALSE)
 		return (NULL);
 
 	for (bp = bheadp; bp != NULL; bp = bp->b_bufp) {
@@ -393,7 +391,7 @@ makelist(void)
 				nbytes--;	/* no bonus newline	 */
 		}
 
-		if (addlinef(blp, "%c%c%c %-*.*s%c%-6d %-*s",
+		if (addlinef(blp, "%c%c%c %-*.*s%c%-6d %-6ld %-*s",
 		    (bp == curbp) ? '>' : ' ',	/* current buffer ? */
 		    ((bp->b_flag & BFCHG) != 0) ? '*' : ' ',	/* changed ? */
 		    ((bp->b_flag & BFREADONLY) != 0) ? '*' : ' ',
@@ -402,7 +400,8 @@ makelist(void)
 		    bp->b_bname,	/* buffer name */
 		    strlen(bp->b_bname) < w - 5 ? ' ' : '$', /* truncated? */
 		    nbytes,		/* buffer size */
-		    w - 7,		/* seven chars already written */
+		    larenasaved(bp),	/* line storage saved by arena */
+		    w - 14,		/* fourteen chars already written */
 		    bp->b_fname) == FALSE)
 			return (NULL);
 	}
@@ -481,22 +480,26 @@ addlinef(struct buffer *bp, char *fmt, ...)
 {
 	va_list		 ap;
 	struct line	*lp;
+	char		*text;
+	int		 len;
 
-	if ((lp = lalloc(0)) == NULL)
-		return (FALSE);
 	va_start(ap, fmt);
-	if (vasprintf(&lp->l_text, fmt, ap) == -1) {
-		lfree(lp);
-		va_end(ap);
+	len = vasprintf(&text, fmt, ap);
+	va_end(ap);
+	if (len == -1)
+		return (FALSE);
+	if ((lp = blalloc(bp, len)) == NULL) {
+		free(text);
 		return (FALSE);
 	}
-	lp->l_used = strlen(lp->l_text);
-	va_end(ap);
+	memcpy(ltext(lp), text, len);
+	free(text);
 
 	bp->b_headp->l_bp->l_fp = lp;		/* Hook onto the end	 */
 	lp->l_bp = bp->b_headp->l_bp;
 	bp->b_headp->l_bp = lp;
 	lp->l_fp = bp->b_headp;
+	lidxlink(bp, lp);
 	bp->b_lines++;
 
 	return (TRUE);
@@ -606,6 +609,9 @@ bnew(const char *bname)
 	bp->b_nmodes = defb_nmodes;
 	TAILQ_INIT(&bp->b_undo);
 	bp->b_undoptr = NULL;
+	bp->b_redoptr = NULL;
+	bp->b_undosize = 0;
+	bp->b_undofloor = FALSE;
 	i = 0;
 	do {
 		bp->b_modes[i] = defb_modes[i];
@@ -644,7 +650,6 @@ bnew(const char *bname)
 int
 bclear(struct buffer *bp)
 {
-	struct line	*lp;
 	int		 s;
 
 	/* Has buffer changed, and do we care? */
@@ -652,8 +657,7 @@ bclear(struct buffer *bp)
 	    (s = eyesno("Buffer modified; kill anyway")) != TRUE)
 		return (s);
 	bp->b_flag &= ~BFCHG;	/* Not changed		 */
-	while ((lp = lforw(bp->b_headp)) != bp->b_headp)
-		lfree(lp);
+	lfreeall(bp);		/* Release all lines at once */
 	bp->b_dotp = bp->b_headp;	/* Fix dot */
 	bp->b_doto = 0;
 	bp->b_markp = NULL;	/* Invalidate "mark"	 */
@@ -795,8 +799,8 @@ bufferinsert(int f, int n)
 {
 	struct buffer *bp;
 	struct line   *clp;
-	int	clo, nline;
-	char	bufn[NBUFN], *bufp;
+	int	nline, len, s;
+	char	bufn[NBUFN], *bufp, *text;
 
 	/* Get buffer to use from user */
 	if (curbp->b_altb != NULL)
@@ -814,18 +818,28 @@ bufferinsert(int f, int n)
 	if (bp == curbp)
 		return(dobeep_msg("Cannot insert buffer into self"));
 
-	/* insert the buffer */
+	/* insert the buffer, lines joined by newlines */
 	nline = 0;
-	clp = bfirstlp(bp);
-	for (;;) {
-		for (clo = 0; clo < llength(clp); clo++)
-			if (linsert(1, lgetc(clp, clo)) == FALSE)
-				return (FALSE);
-		if ((clp = lforw(clp)) == bp->b_headp)
-			break;
-		if (enewline(FFRAND, 1) == FALSE)	/* fake newline */
+	len = 0;
+	for (clp = bfirstlp(bp); clp != bp->b_headp; clp = lforw(clp))
+		len += llength(clp) + 1;
+	if (len > 0) {
+		if ((text = malloc(len)) == NULL)
+			return (dobeep_msg("Out of memory"));
+		len = 0;
+		for (clp = bfirstlp(bp); clp != bp->b_headp; clp = lforw(clp)) {
+			if (clp != bfirstlp(bp)) {
+				text[len++] = *curbp->b_nlchr;
+				nline++;
+			}
+			if (llength(clp) > 0)
+				memcpy(&text[len], ltext(clp), llength(clp));
+			len += llength(clp);
+		}
+		s = linsert_str(text, len);
+		free(text);
+		if (s == FALSE)
 			return (FALSE);
-		nline++;
 	}
 	if (nline == 1)
 		ewprintf("[Inserted 1 line]");
@@ -966,7 +980,6 @@ int
 dorevert(void)
 {
 	int lineno;
-	struct undo_rec *rec;
 
 	if (access(curbp->b_fname, F_OK|R_OK) != 0) {
 		dobeep();
@@ -986,10 +999,7 @@ dorevert(void)
 	curbp->b_flag &= ~BFCHG;
 
 	/* Clean up undo memory */
-	while ((rec = TAILQ_FIRST(&curbp->b_undo))) {
-		TAILQ_REMOVE(&curbp->b_undo, rec, next);
-		free_undo_record(rec);
-	}
+	undo_clear(curbp);
 
 	if (readin(curbp->b_fname))
 		return(setlineno(lineno));
@@ -51,11 +51,13 @@ typedef int	(*PF)(int, int);	/* generally useful type */
  * some aspects of the last command. The CFCPCN
  * flag controls goal column setting. The CFKILL
  * flag controls the clearing versus appending
- * of data in the kill buffer.
+ * of data in the kill buffer.  The CFYANK flag
+ * lets yank-pop replace the text just yanked.
  */
 #define CFCPCN	0x0001		/* Last command was C-p or C-n	 */
 #define CFKILL	0x0002		/* Last command was a kill	 */
 #define CFINS	0x0004		/* Last command was self-insert	 */
+#define CFYANK	0x0008		/* Last command was a yank	 */
 
 /*
  * File I/O.
@@ -144,6 +146,8 @@ struct line {
 	int		 l_size;	/* Allocated size		 */
 	int		 l_used;	/* Used size			 */
 	char		*l_text;	/* Content of the line		 */
+	struct lchunk	*l_chunk;	/* Position index chunk		 */
+	unsigned int	 l_gen;		/* Change stamp, for redisplay	 */
 };
 
 /*
@@ -157,10 +161,18 @@ struct line {
 #define lforw(lp)	((lp)->l_fp)
 #define lback(lp)	((lp)->l_bp)
 #define lgetc(lp, n)	(CHARMASK((lp)->l_text[(n)]))
-#define lputc(lp, n, c) ((lp)->l_text[(n)]=(c))
+#define lputc(lp, n, c) (ltouch(lp), (lp)->l_text[(n)]=(c))
+#define ltouch(lp)	((lp)->l_gen = ++lgen)
 #define llength(lp)	((lp)->l_used)
 #define ltext(lp)	((lp)->l_text)
 
+/*
+ * A line with text but no allocated size has not been changed since
+ * it was read: its text still lies in the block the file was read
+ * into (see blfile() in line.c), followed by the newline.
+ */
+#define lfiletext(lp)	((lp)->l_size == 0 && (lp)->l_text != NULL)
+
 /*
  * All repeated structures are kept as linked lists of structures.
  * All of these start with a LIST structure (except lines, which
@@ -211,6 +223,9 @@ struct mgwin {
 	struct line	*w_wrapline;
 	int		 w_dotline;	/* current line number of dot	*/
 	int		 w_markline;	/* current line number of mark	*/
+	int		 w_dotrow;	/* cached row of dot, see dotrow() */
+	struct line	*w_rowlinep;	/* w_linep when w_dotrow was set */
+	struct line	*w_rowdotp;	/* w_dotp when w_dotrow was set	*/
 };
 #define w_wndp	w_list.l_p.l_wp
 #define w_name	w_list.l_name
@@ -239,6 +254,52 @@ struct mgwin {
 struct undo_rec;
 TAILQ_HEAD(undoq, undo_rec);
 
+/*
+ * The lines of a buffer, and their text when it is short, are carved
+ * out of large blocks belonging to the buffer instead of being
+ * malloc()ed one at a time. Freed pieces are kept on a list per size
+ * class for reuse, and the blocks all go back at once when the buffer
+ * is cleared. See blalloc() and friends in line.c.
+ */
+#define LA_GRAIN	16		/* Arena piece size granularity	 */
+#define LA_NCLASS	16		/* Number of piece size classes	 */
+#define LA_MAXCHUNK	(LA_GRAIN * LA_NCLASS)	/* Largest piece	 */
+
+struct lablock;
+
+struct larena {
+	struct lablock	*la_blocks;	/* Blocks, newest first		 */
+	char		*la_next;	/* Free space in newest block	 */
+	size_t		 la_left;	/* Bytes left in newest block	 */
+	void		*la_free[LA_NCLASS]; /* Freed pieces, by size	 */
+	size_t		 la_nblocks;	/* Number of blocks		 */
+	size_t		 la_nchunks;	/* Pieces in use		 */
+	size_t		 la_freebytes;	/* Bytes in freed pieces	 */
+	struct lablock	*la_texts;	/* File text blocks, FILEBLOCK	 */
+};
+
+/*
+ * Position index of a buffer.  The lines are grouped into runs of
+ * consecutive lines, and Fenwick trees over the byte and line counts
+ * of the runs turn a line into an absolute position (and back) in
+ * logarithmic time.  See lidxpos() and friends in line.c.
+ */
+struct lchunk {
+	struct line	*lc_first;	/* First line of the run	 */
+	int		 lc_idx;	/* Index in li_chunks		 */
+	int		 lc_lines;	/* Number of lines		 */
+	long		 lc_bytes;	/* Their length, with newlines	 */
+};
+
+struct lindex {
+	struct lchunk	**li_chunks;	/* Runs, in buffer order	 */
+	long		*li_bytes;	/* Fenwick tree of lc_bytes	 */
+	long		*li_lines;	/* Fenwick tree of lc_lines	 */
+	int		 li_nchunks;	/* Number of runs		 */
+	int		 li_alloc;	/* Allocated size of the arrays	 */
+	int		 li_valid;	/* Index matches the buffer	 */
+};
+
 /*
  * Previously from sysdef.h
  * Only used in struct buffer.
@@ -250,6 +311,22 @@ struct fileinfo {
         struct timespec fi_mtime;       /* Last modified time */
 };
 
+/*
+ * State for reading a file in large blocks and handing its lines
+ * out in place, rather than a byte at a time. See ffreadline().
+ */
+struct ffreader {
+	FILE		*fr_fp;		/* File being read		 */
+	char		*fr_buf;	/* Block buffer			 */
+	size_t		 fr_size;	/* Allocated size of fr_buf	 */
+	size_t		 fr_len;	/* Bytes of valid data in fr_buf */
+	size_t		 fr_pos;	/* Start of the next line	 */
+	size_t		 fr_scan;	/* Searched this far for newline */
+	int		 fr_nlchr;	/* Newline character		 */
+	int		 fr_eof;	/* End of file has been read	 */
+	struct buffer	*fr_bp;		/* Buffer being read into	 */
+};
+
 /*
  * Text is kept in buffers. A buffer header, described
  * below, exists for every buffer in the system. The buffers are
@@ -280,9 +357,14 @@ struct buffer {
 	struct fileinfo	 b_fi;		/* File attributes		 */
 	struct undoq	 b_undo;	/* Undo actions list		 */
 	struct undo_rec *b_undoptr;
+	struct undo_rec *b_redoptr;	/* Where undo-redo goes on	 */
+	size_t		 b_undosize;	/* Bytes held by undo records	 */
+	int		 b_undofloor;	/* Undo history will not shrink	 */
 	int		 b_dotline;	/* Line number of dot */
 	int		 b_markline;	/* Line number of mark */
 	int		 b_lines;	/* Number of lines in file	*/
+	struct larena	 b_arena;	/* Storage for lines		 */
+	struct lindex	 b_index;	/* Line position index		 */
 };
 #define b_bufp	b_list.l_p.x_bp
 #define b_bname b_list.l_name
@@ -309,10 +391,14 @@ struct undo_rec {
 		DELETE,
 		BOUNDARY,
 		MODIFIED,
-		DELREG
+		DELREG,
+		BULK
 	} type;
 	struct region	 region;
 	int		 pos;
+	int		 dotoff;	/* Dot after undo, from pos	 */
+	int		 byundo;	/* Recorded by undo()		 */
+	int		 newsize;	/* BULK: bytes now in its place	 */
 	char		*content;
 };
 
@@ -371,6 +457,7 @@ int		 ttcooked(void);
 int		 ttputc(int);
 void		 ttflush(void);
 int		 ttgetc(void);
+void		 ttungetc(int);
 int		 ttwait(int);
 int		 charswaiting(void);
 
@@ -408,12 +495,31 @@ int		 do_filevisitalt(char *);
 /* line.c X */
 struct line	*lalloc(int);
 int		 lrealloc(struct line *, int);
-void		 lfree(struct line *);
+struct line	*blalloc(struct buffer *, int);
+int		 blrealloc(struct buffer *, struct line *, int);
+void		 blfree(struct buffer *, struct line *);
+struct line	*blfile(struct buffer *, char *, int);
+char		*latext(struct buffer *, size_t);
+void		 lfree(struct buffer *, struct line *);
+void		 lfreeall(struct buffer *);
+long		 larenasaved(struct buffer *);
+void		 lidxlink(struct buffer *, struct line *);
+void		 lidxunlink(struct buffer *, struct line *);
+void		 lidxreplace(struct buffer *, struct line *, struct line *);
+void		 lidxresize(struct buffer *, struct line *, int);
+void		 lidxinval(struct buffer *);
+void		 lidxfree(struct buffer *);
+int		 lidxpos(struct buffer *, struct line *, int, int *);
+int		 lidxfind(struct buffer *, int, struct line **, int *, int *);
+int		 lidxnlines(struct buffer *);
+struct line	*lidxline(struct buffer *, int);
 void		 lchange(int);
 int		 linsert(int, int);
+int		 linsert_str(const char *, int);
 int		 lnewline_at(struct line *, int);
 int		 lnewline(void);
 int		 ldelete(RSIZE, int);
+int		 ldellines(struct line *, int, const char *, int);
 int		 ldelnewline(void);
 int		 lreplace(RSIZE, char *);
 char *		 linetostr(const struct line *);
@@ -425,8 +531,12 @@ void		 kdelete(void);
 int		 kinsert(int, int);
 int		 kremove(int);
 int		 kchunk(char *, RSIZE, int);
+char		*kreserve(RSIZE, int);
+void		 kunreserve(RSIZE, int);
 int		 killline(int, int);
 int		 yank(int, int);
+int		 yankpop(int, int);
+int		 setkillringlen(int, int);
 
 /* window.c X */
 struct mgwin	*new_window(struct buffer *);
@@ -474,8 +584,12 @@ int		 vtresize(int, int, int);
 void		 vtinit(void);
 void		 vttidy(void);
 void		 update(int);
+void		 schedupdate(int);
+void		 idleupdate(void);
 int		 linenotoggle(int, int);
 int		 colnotoggle(int, int);
+int		 setframeinterval(int, int);
+int		 syncouttoggle(int, int);
 
 /* echo.c X */
 void		 eerase(void);
@@ -495,6 +609,9 @@ int		 ffwopen(FILE **, const char *, struct buffer *);
 int		 ffclose(FILE *, struct buffer *);
 int		 ffputbuf(FILE *, struct buffer *, int);
 int		 ffgetline(FILE *, char *, int, int *);
+int		 ffreadinit(struct ffreader *, FILE *, struct buffer *);
+int		 ffreadline(struct ffreader *, char **, int *);
+void		 ffreadfree(struct ffreader *);
 int		 fbackupfile(const char *);
 char		*adjustname(const char *, int);
 FILE		*startupfile(char *, char *, char *, size_t);
@@ -505,6 +622,8 @@ int		 fchecktime(struct buffer *);
 int		 fupdstat(struct buffer *);
 int		 backuptohomedir(int, int);
 int		 toggleleavetmp(int, int);
+int		 fsynconsave(int, int);
+int		 toggleatomicsave(int, int);
 char		*expandtilde(const char *);
 
 /* kbd.c X */
@@ -672,7 +791,10 @@ int		 spawncli(int, int);
 
 /* ttykbd.c X */
 void		 ttykeymapinit(void);
+void		 ttykeymapreinit(void);
 void		 ttykeymaptidy(void);
+int		 ttykbdgetc(void);
+int		 bpaste(int, int);
 
 /* match.c X */
 int		 showmatch(int, int);
@@ -709,6 +831,7 @@ int		 cntnonmatchlines(int, int);
 
 /* undo.c X */
 void		 free_undo_record(struct undo_rec *);
+void		 undo_clear(struct buffer *);
 int		 undo_dump(int, int);
 int		 undo_enabled(void);
 int		 undo_enable(int, int);
@@ -718,7 +841,10 @@ int		 undo_add_insert(struct line *, int, int);
 int		 undo_add_delete(struct line *, int, int, int);
 int		 undo_boundary_enable(int, int);
 int		 undo_add_change(struct line *, int, int);
+void		 undo_bulk_begin(void);
+void		 undo_bulk_end(void);
 int		 undo(int, int);
+int		 undo_redo(int, int);
 
 /* autoexec.c X */
 int		 auto_execute(int, int);
@@ -765,6 +891,7 @@ extern int		 curgoal;
 extern int		 startrow;
 extern int		 epresf;
 extern int		 sgarbf;
+extern unsigned int	 lgen;
 extern int		 nrow;
 extern int		 ncol;
 extern int		 ttrow;
@@ -781,6 +908,7 @@ extern int		 allbro;
 extern int		 batch;
 extern char	 	 cinfo[];
 extern char		*keystrings[];
+extern int		 inpaste;
 extern char		 pat[NPAT];
 extern char		 prompt[];
 extern int		 tceeol;
@@ -457,7 +457,7 @@ d_expunge(int f, int n)
 				}
 				break;
 			}
-			lfree(lp);
+			lfree(curbp, lp);
 			curwp->w_bufp->b_lines--;
 			if (tmp > curwp->w_dotline)
 				tmp--;
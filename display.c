@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <term.h>
+#include <time.h>
 
 #include "def.h"
 #include "kbd.h"
@@ -34,6 +35,9 @@ struct video {
 	short	v_color;	/* Color of the line.		 */
 	int	v_cost;		/* Cost of display.		 */
 	char	*v_text;	/* The actual characters.	 */
+	struct line *v_lp;	/* Line drawn here, or NULL.	 */
+	unsigned int v_gen;	/* Its change stamp when drawn.	 */
+	int	v_tabw;		/* Tab width it was drawn with.	 */
 };
 
 #define VFCHG	0x0001			/* Changed.			 */
@@ -63,7 +67,14 @@ void	traceback(int, int, int, int);
 void	ucopy(struct video *, struct video *);
 void	uline(int, struct video *, struct video *);
 void	hash(struct video *);
-
+static int	vtsame(struct video *, struct line *, int);
+static struct video *vtfind(int, struct line *, int);
+static void	vtline(int, struct line *, struct mgwin *);
+static int	dotrow(struct mgwin *);
+static int	vtmatch(const char *, const char *, int);
+static int	scrolled(int, int);
+static int	framewait(void);
+static void	frameflush(void);
 
 int	sgarbf = TRUE;		/* TRUE if screen is garbage.	 */
 int	vtrow = HUGE;		/* Virtual cursor row.		 */
@@ -81,6 +92,22 @@ struct video	**pscreen;		/* Edge vector, physical.	 */
 struct video	 *video;		/* Actual screen data.		 */
 struct video	  blanks;		/* Blank line image.		 */
 
+/*
+ * Redisplay scheduling.  When frameinterval is non-zero the command
+ * loop paints at most once per that many milliseconds; a frame held
+ * back is painted as soon as the keyboard goes quiet.  With syncout
+ * each frame is bracketed by the synchronized output markers so the
+ * terminal shows it all at once.
+ */
+static int		frameinterval = 0;	/* Minimum ms between frames. */
+static int		framepending = FALSE;	/* A frame was held back.     */
+static int		framecolor;		/* Its modeline color.	      */
+static int		syncout = FALSE;	/* Bracket frames.	      */
+static struct timespec	lastframe;		/* When the last was painted. */
+
+#define SYNC_BEGIN	"\033[?2026h"
+#define SYNC_END	"\033[?2026l"
+
 /*
  * This matrix is written as an array because
  * we do funny things in the "setscores" routine, which
@@ -128,6 +155,53 @@ colnotoggle(int f, int n)
 	return (TRUE);
 }
 
+/*
+ * Set the minimum interval between frames painted by the command loop,
+ * in milliseconds.  Zero paints after every command.
+ */
+int
+setframeinterval(int f, int n)
+{
+	char buf[32], *rep;
+	const char *es;
+	int msec;
+
+	if ((f & FFARG) != 0) {
+		if (n < 0 || n > 1000) {
+			dobeep();
+			ewprintf("Invalid frame interval: %d", n);
+			return (FALSE);
+		}
+		frameinterval = n;
+	} else {
+		if ((rep = eread("Set frame interval: ", buf, sizeof(buf),
+		    EFNEW | EFCR)) == NULL)
+			return (ABORT);
+		else if (rep[0] == '\0')
+			return (FALSE);
+		msec = strtonum(rep, 0, 1000, &es);
+		if (es != NULL) {
+			dobeep();
+			ewprintf("Invalid frame interval: %s", rep);
+			return (FALSE);
+		}
+		frameinterval = msec;
+		ewprintf("Frame interval set to %d ms", frameinterval);
+	}
+	return (TRUE);
+}
+
+int
+syncouttoggle(int f, int n)
+{
+	if (f & FFARG)
+		syncout = n > 0;
+	else
+		syncout = !syncout;
+
+	return (TRUE);
+}
+
 /*
  * Reinit the display data structures, this is called when the terminal
  * size changes.
@@ -213,8 +287,10 @@ vtresize(int force, int newrow, int newcol)
 		}
 	}
 	if (rowchanged || colchanged || first_run) {
-		for (i = 0; i < 2 * (newrow - 1); i++)
+		for (i = 0; i < 2 * (newrow - 1); i++) {
 			TRYREALLOC(video[i].v_text, newcol);
+			video[i].v_lp = NULL;
+		}
 		TRYREALLOC(blanks.v_text, newcol);
 	}
 
@@ -388,6 +464,108 @@ vteeol(void)
 		vp->v_text[vtcol++] = ' ';
 }
 
+/*
+ * Does the row in vp hold line lp, unchanged since it was drawn with
+ * tab width tabw?  Extended rows are scrolled sideways, so never count.
+ */
+static int
+vtsame(struct video *vp, struct line *lp, int tabw)
+{
+	return (vp->v_lp == lp && vp->v_gen == lp->l_gen &&
+	    vp->v_tabw == tabw && vp->v_color == CTEXT &&
+	    (vp->v_flag & VFEXT) == 0);
+}
+
+/*
+ * Find line lp on the physical screen.  Lines that scroll all move by
+ * the same amount, so try the offset of the last match first.
+ */
+static struct video *
+vtfind(int row, struct line *lp, int tabw)
+{
+	static int	 delta;
+	int		 i;
+
+	i = row + delta;
+	if (i >= 0 && i < nrow - 1 && vtsame(pscreen[i], lp, tabw))
+		return (pscreen[i]);
+	for (i = 0; i < nrow - 1; ++i) {
+		if (vtsame(pscreen[i], lp, tabw)) {
+			delta = i - row;
+			return (pscreen[i]);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Put line lp into the given row of the virtual screen.  A row remembers
+ * the line and change stamp it was drawn from, so an unchanged line is
+ * left alone if it is already in the row, or copied from wherever it is
+ * on the physical screen.  Only lines that really changed go through
+ * vtputc().
+ */
+static void
+vtline(int row, struct line *lp, struct mgwin *wp)
+{
+	struct video	*vp, *pp;
+	int		 tabw, j;
+
+	vp = vscreen[row];
+	tabw = wp->w_bufp->b_tabw;
+	if (vtsame(vp, lp, tabw))
+		return;
+	vp->v_color = CTEXT;
+	if ((pp = vtfind(row, lp, tabw)) != NULL) {
+		bcopy(pp->v_text, vp->v_text, ncol);
+		vp->v_hash = pp->v_hash;
+		vp->v_cost = pp->v_cost;
+		vp->v_flag &= ~VFHBAD;
+		vp->v_flag |= VFCHG | (pp->v_flag & VFHBAD);
+	} else {
+		vp->v_flag |= (VFCHG | VFHBAD);
+		vtmove(row, 0);
+		for (j = 0; j < llength(lp); ++j)
+			vtputc(lgetc(lp, j), wp);
+		vteeol();
+	}
+	vp->v_lp = lp;
+	vp->v_gen = lp->l_gen;
+	vp->v_tabw = tabw;
+}
+
+/*
+ * Return the row of dot in window wp, counting from the top of the
+ * window, or -1 if dot is not in the window.  The answer is kept until
+ * dot or the top line moves, or the window needs a full update.
+ */
+static int
+dotrow(struct mgwin *wp)
+{
+	struct line	*lp;
+	int		 i;
+
+	if ((wp->w_rflag & WFFULL) == 0 && wp->w_rowlinep == wp->w_linep &&
+	    wp->w_rowdotp == wp->w_dotp && wp->w_dotrow < wp->w_ntrows)
+		return (wp->w_dotrow);
+	lp = wp->w_linep;
+	for (i = 0; i < wp->w_ntrows; ++i) {
+		if (lp == wp->w_dotp)
+			break;
+		if (lp == wp->w_bufp->b_headp) {
+			i = wp->w_ntrows;
+			break;
+		}
+		lp = lforw(lp);
+	}
+	if (i == wp->w_ntrows)
+		i = -1;
+	wp->w_rowlinep = wp->w_linep;
+	wp->w_rowdotp = wp->w_dotp;
+	wp->w_dotrow = i;
+	return (i);
+}
+
 /*
  * Make sure that the display is
  * right. This is a three part process. First,
@@ -404,13 +582,17 @@ update(int modelinecolor)
 	struct mgwin	*wp;
 	struct video	*vp1;
 	struct video	*vp2;
-	int	 c, i, j;
+	int	 c, i;
 	int	 hflag;
 	int	 currow, curcol;
 	int	 offs, size;
 
 	if (charswaiting())
 		return;
+	clock_gettime(CLOCK_MONOTONIC, &lastframe);
+	framepending = FALSE;
+	if (syncout)
+		putpad(SYNC_BEGIN, 1);
 	if (sgarbf) {		/* must update everything */
 		wp = wheadp;
 		while (wp != NULL) {
@@ -433,16 +615,8 @@ update(int modelinecolor)
 		if (wp->w_rflag == 0)
 			continue;
 
-		if ((wp->w_rflag & WFFRAME) == 0) {
-			lp = wp->w_linep;
-			for (i = 0; i < wp->w_ntrows; ++i) {
-				if (lp == wp->w_dotp)
-					goto out;
-				if (lp == wp->w_bufp->b_headp)
-					break;
-				lp = lforw(lp);
-			}
-		}
+		if ((wp->w_rflag & WFFRAME) == 0 && dotrow(wp) >= 0)
+			goto out;
 		/*
 		 * Put the middle-line in place.
 		 */
@@ -472,28 +646,18 @@ update(int modelinecolor)
 		lp = wp->w_linep;	/* Try reduced update.	 */
 		i = wp->w_toprow;
 		if ((wp->w_rflag & ~WFMODE) == WFEDIT) {
-			while (lp != wp->w_dotp) {
-				++i;
-				lp = lforw(lp);
-			}
-			vscreen[i]->v_color = CTEXT;
-			vscreen[i]->v_flag |= (VFCHG | VFHBAD);
-			vtmove(i, 0);
-			for (j = 0; j < llength(lp); ++j)
-				vtputc(lgetc(lp, j), wp);
-			vteeol();
+			vtline(i + dotrow(wp), wp->w_dotp, wp);
 		} else if ((wp->w_rflag & (WFEDIT | WFFULL)) != 0) {
 			hflag = TRUE;
+			wp->w_rowlinep = wp->w_linep;
+			wp->w_rowdotp = wp->w_dotp;
+			wp->w_dotrow = -1;
 			while (i < wp->w_toprow + wp->w_ntrows) {
-				vscreen[i]->v_color = CTEXT;
-				vscreen[i]->v_flag |= (VFCHG | VFHBAD);
-				vtmove(i, 0);
-				if (lp != wp->w_bufp->b_headp) {
-					for (j = 0; j < llength(lp); ++j)
-						vtputc(lgetc(lp, j), wp);
+				if (lp == wp->w_dotp && wp->w_dotrow < 0)
+					wp->w_dotrow = i - wp->w_toprow;
+				vtline(i, lp, wp);
+				if (lp != wp->w_bufp->b_headp)
 					lp = lforw(lp);
-				}
-				vteeol();
 				++i;
 			}
 		}
@@ -502,12 +666,8 @@ update(int modelinecolor)
 		wp->w_rflag = 0;
 		wp->w_frame = 0;
 	}
-	lp = curwp->w_linep;	/* Cursor location. */
-	currow = curwp->w_toprow;
-	while (lp != curwp->w_dotp) {
-		++currow;
-		lp = lforw(lp);
-	}
+	lp = curwp->w_dotp;	/* Cursor location. */
+	currow = curwp->w_toprow + dotrow(curwp);
 	curcol = 0;
 	i = 0;
 	while (i < curwp->w_doto) {
@@ -546,12 +706,9 @@ update(int modelinecolor)
 				vscreen[i]->v_flag |= VFCHG;
 				if ((wp != curwp) || (lp != wp->w_dotp) ||
 				    (curcol < ncol - 1)) {
-					vtmove(i, 0);
-					for (j = 0; j < llength(lp); ++j)
-						vtputc(lgetc(lp, j), wp);
-					vteeol();
 					/* this line no longer is extended */
 					vscreen[i]->v_flag &= ~VFEXT;
+					vtline(i, lp, wp);
 				}
 			}
 			lp = lforw(lp);
@@ -577,7 +734,7 @@ update(int modelinecolor)
 			ucopy(vscreen[i], pscreen[i]);
 		}
 		ttmove(currow, curcol - lbound);
-		ttflush();
+		frameflush();
 		return;
 	}
 	if (hflag != FALSE) {			/* Hard update?		*/
@@ -598,7 +755,7 @@ update(int modelinecolor)
 		}
 		if (offs == nrow - 1) {		/* Might get it all.	*/
 			ttmove(currow, curcol - lbound);
-			ttflush();
+			frameflush();
 			return;
 		}
 		size = nrow - 1;		/* Get bottom match.	*/
@@ -614,12 +771,14 @@ update(int modelinecolor)
 		}
 		if ((size -= offs) == 0)	/* Get screen size.	*/
 			panic("Illegal screen size in update");
-		setscores(offs, size);		/* Do hard update.	*/
-		traceback(offs, size, size, size);
+		if (scrolled(offs, size) == FALSE) {
+			setscores(offs, size);	/* Do hard update.	*/
+			traceback(offs, size, size, size);
+		}
 		for (i = 0; i < size; ++i)
 			ucopy(vscreen[offs + i], pscreen[offs + i]);
 		ttmove(currow, curcol - lbound);
-		ttflush();
+		frameflush();
 		return;
 	}
 	for (i = 0; i < nrow - 1; ++i) {	/* Easy update.		*/
@@ -631,9 +790,156 @@ update(int modelinecolor)
 		}
 	}
 	ttmove(currow, curcol - lbound);
+	frameflush();
+}
+
+/*
+ * End a frame painted by update.
+ */
+static void
+frameflush(void)
+{
+	if (syncout)
+		putpad(SYNC_END, 1);
 	ttflush();
 }
 
+/*
+ * Return how many milliseconds remain before the command loop may
+ * paint another frame.
+ */
+static int
+framewait(void)
+{
+	struct timespec now;
+	long	 msec;
+
+	if (frameinterval == 0)
+		return (0);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msec = (now.tv_sec - lastframe.tv_sec) * 1000 +
+	    (now.tv_nsec - lastframe.tv_nsec) / 1000000;
+	if (msec < 0 || msec >= frameinterval)
+		return (0);
+	return (frameinterval - msec);
+}
+
+/*
+ * Redisplay from the command loop.  Inside the frame interval the
+ * window flags are left to accumulate and the frame is painted later,
+ * by the next call past the interval or by idleupdate.
+ */
+void
+schedupdate(int modelinecolor)
+{
+	if (framewait() > 0) {
+		framepending = TRUE;
+		framecolor = modelinecolor;
+		return;
+	}
+	update(modelinecolor);
+}
+
+/*
+ * Called before blocking for a key.  Paint a held-back frame once the
+ * interval runs out, unless input shows up first.
+ */
+void
+idleupdate(void)
+{
+	if (!framepending)
+		return;
+	if (ttwait(framewait()) == FALSE)
+		return;
+	update(framecolor);
+}
+
+/*
+ * Return the length of the common prefix of a and b, which are len
+ * bytes long.  Compare a word at a time while we can.
+ */
+static int
+vtmatch(const char *a, const char *b, int len)
+{
+	unsigned long	 wa, wb;
+	int		 i;
+
+	for (i = 0; len - i >= (int)sizeof(wa); i += sizeof(wa)) {
+		memcpy(&wa, &a[i], sizeof(wa));
+		memcpy(&wb, &b[i], sizeof(wb));
+		if (wa != wb)
+			break;
+	}
+	while (i < len && a[i] == b[i])
+		++i;
+	return (i);
+}
+
+/*
+ * Handle the common case of a hard update where the changed chunk of
+ * the screen has only been scrolled up or down by some rows, without
+ * building the score matrix.  One row above the scroll, such as the
+ * line being edited, and one row below it, such as a mode line, may
+ * change as well.  Return FALSE if the chunk is not such a scroll, or
+ * if scrolling costs more than drawing the moved rows again.
+ */
+static int
+scrolled(int offs, int size)
+{
+	struct video	*vp1, *vp2;
+	int	 head, up, top, bot, d, n, i, cost;
+
+	for (head = 0; head < 2 && head < size; ++head) {
+		top = offs + head;
+		for (up = 0; up < 2; ++up) {
+			/* Find where the top row came from. */
+			for (d = 1; d < size - head; ++d) {
+				vp1 = vscreen[top + (up ? 0 : d)];
+				vp2 = pscreen[top + (up ? d : 0)];
+				if (vp1->v_color == vp2->v_color &&
+				    vp1->v_hash == vp2->v_hash)
+					break;
+			}
+			if (d == size - head)
+				continue;
+			/* Count the rows that moved along with it. */
+			cost = 0;
+			for (n = 0; n < size - head - d; ++n) {
+				vp1 = vscreen[top + n + (up ? 0 : d)];
+				vp2 = pscreen[top + n + (up ? d : 0)];
+				if (vp1->v_color != vp2->v_color ||
+				    vp1->v_hash != vp2->v_hash)
+					break;
+				cost += vp1->v_cost;
+			}
+			bot = top + n + d - 1;
+			if (offs + size - 1 - bot > 1 ||
+			    d * (up ? tcdell : tcinsl) >= cost)
+				continue;
+			ttcolor(CTEXT);
+			if (up) {
+				ttdell(top, bot, d);
+				for (i = top; i < top + n; ++i)
+					uline(i, vscreen[i], pscreen[i + d]);
+				for (; i <= bot; ++i)
+					uline(i, vscreen[i], &blanks);
+			} else {
+				ttinsl(top, bot, d);
+				for (i = top; i < top + d; ++i)
+					uline(i, vscreen[i], &blanks);
+				for (; i <= bot; ++i)
+					uline(i, vscreen[i], pscreen[i - d]);
+			}
+			for (i = offs; i < top; ++i)
+				uline(i, vscreen[i], pscreen[i]);
+			for (i = bot + 1; i < offs + size; ++i)
+				uline(i, vscreen[i], pscreen[i]);
+			return (TRUE);
+		}
+	}
+	return (FALSE);
+}
+
 /*
  * Update a saved copy of a line,
  * kept in a video structure. The "vvp" is
@@ -650,6 +956,9 @@ ucopy(struct video *vvp, struct video *pvp)
 	pvp->v_hash = vvp->v_hash;
 	pvp->v_cost = vvp->v_cost;
 	pvp->v_color = vvp->v_color;
+	pvp->v_lp = vvp->v_lp;
+	pvp->v_gen = vvp->v_gen;
+	pvp->v_tabw = vvp->v_tabw;
 	bcopy(vvp->v_text, pvp->v_text, ncol);
 }
 
@@ -677,6 +986,7 @@ updext(int currow, int curcol)
 	 * scan through the line outputting characters to the virtual screen
 	 * once we reach the left edge
 	 */
+	vscreen[currow]->v_lp = NULL;		/* not a plain copy of lp */
 	vtmove(currow, -lbound);		/* start scanning offscreen */
 	lp = curwp->w_dotp;			/* line to output */
 	for (j = 0; j < llength(lp); ++j)	/* until the end-of-line */
@@ -702,7 +1012,8 @@ uline(int row, struct video *vvp, struct video *pvp)
 	char  *cp3;
 	char  *cp4;
 	char  *cp5;
-	int    nbflag;
+	int    nbflag, n;
+	unsigned long w1, w2, bw;
 
 	if (vvp->v_color != pvp->v_color) {	/* Wrong color, do a	 */
 		ttmove(row, 0);			/* full redraw.		 */
@@ -731,17 +1042,25 @@ uline(int row, struct video *vvp, struct video *pvp)
 		ttcolor(CTEXT);
 		return;
 	}
-	cp1 = &vvp->v_text[0];		/* Compute left match.	 */
-	cp2 = &pvp->v_text[0];
-	while (cp1 != &vvp->v_text[ncol] && cp1[0] == cp2[0]) {
-		++cp1;
-		++cp2;
-	}
+	n = vtmatch(vvp->v_text, pvp->v_text, ncol);
+	cp1 = &vvp->v_text[n];		/* Compute left match.	 */
+	cp2 = &pvp->v_text[n];
 	if (cp1 == &vvp->v_text[ncol])	/* All equal.		 */
 		return;
 	nbflag = FALSE;
 	cp3 = &vvp->v_text[ncol];	/* Compute right match.  */
 	cp4 = &pvp->v_text[ncol];
+	memset(&bw, ' ', sizeof(bw));
+	while (cp3 - cp1 >= (long)sizeof(w1)) {	/* A word at a time. */
+		memcpy(&w1, cp3 - sizeof(w1), sizeof(w1));
+		memcpy(&w2, cp4 - sizeof(w2), sizeof(w2));
+		if (w1 != w2)
+			break;
+		if (w1 != bw)
+			nbflag = TRUE;
+		cp3 -= sizeof(w1);
+		cp4 -= sizeof(w2);
+	}
 	while (cp3[-1] == cp4[-1]) {
 		--cp3;
 		--cp4;
@@ -794,6 +1113,7 @@ modeline(struct mgwin *wp, int modelinecolor)
 	n = wp->w_toprow + wp->w_ntrows;	/* Location.		 */
 	vscreen[n]->v_color = modelinecolor;	/* Mode line color.	 */
 	vscreen[n]->v_flag |= (VFCHG | VFHBAD);	/* Recompute, display.	 */
+	vscreen[n]->v_lp = NULL;		/* No buffer line here.	 */
 	vtmove(n, 0);				/* Seek to right line.	 */
 	bp = wp->w_bufp;
 	vtputc('-', wp);
@@ -879,21 +1199,34 @@ vtputs(const char *s, struct mgwin *wp)
 void
 hash(struct video *vp)
 {
-	int	i, n;
-	char   *s;
+	unsigned long	 h, w, bw;
+	int		 i, j, n;
+	char		*s;
 
 	if ((vp->v_flag & VFHBAD) != 0) {	/* Hash bad.		 */
-		s = &vp->v_text[ncol - 1];
-		for (i = ncol; i != 0; --i, --s)
-			if (*s != ' ')
+		s = vp->v_text;
+		memset(&bw, ' ', sizeof(bw));
+		for (i = ncol; i >= (int)sizeof(w); i -= sizeof(w)) {
+			memcpy(&w, &s[i - sizeof(w)], sizeof(w));
+			if (w != bw)
 				break;
+		}
+		while (i != 0 && s[i - 1] == ' ')
+			--i;
 		n = ncol - i;			/* Erase cheaper?	 */
 		if (n > tceeol)
 			n = tceeol;
 		vp->v_cost = i + n;		/* Bytes + blanks.	 */
-		for (n = 0; i != 0; --i, --s)
-			n = (n << 5) + n + *s;
-		vp->v_hash = n;			/* Hash code.		 */
+		h = 0;
+		for (j = 0; i - j >= (int)sizeof(w); j += sizeof(w)) {
+			memcpy(&w, &s[j], sizeof(w));
+			h = (h << 5) + h + w;
+		}
+		for (; j < i; ++j)
+			h = (h << 5) + h + (unsigned char)s[j];
+		for (n = sizeof(h) * 8 / 2; n >= 16; n /= 2)
+			h ^= h >> n;		/* Fold into a short.	 */
+		vp->v_hash = h;			/* Hash code.		 */
 		vp->v_flag &= ~VFHBAD;		/* Flag as all done.	 */
 	}
 }
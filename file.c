@@ -289,9 +289,6 @@ readin(char *fname)
  * but not on a new file. You don't need to make a backup copy of nothing.
  */
 
-static char	*line = NULL;
-static int	linesize = 0;
-
 int
 insertfile(char *fname, char *newname, int replacebuf)
 {
@@ -299,6 +296,8 @@ insertfile(char *fname, char *newname, int replacebuf)
 	struct line	*lp1, *lp2;
 	struct line	*olp;			/* line we started at */
 	struct mgwin	*wp;
+	struct ffreader	 fr;
+	char	*line;
 	int	 nbytes, s, nline = 0, siz, x, x2;
 	int	 opos;			/* offset we started at */
 	int	 oline;			/* original line number */
@@ -310,12 +309,6 @@ insertfile(char *fname, char *newname, int replacebuf)
 		x = undo_enabled();
 
 	lp1 = NULL;
-	if (line == NULL) {
-		line = malloc(NLINE);
-		if (line == NULL)
-			panic("out of memory");
-		linesize = NLINE;
-	}
 
 	/* cheap */
 	bp = curbp;
@@ -355,6 +348,10 @@ insertfile(char *fname, char *newname, int replacebuf)
 		(void)xdirname(bp->b_cwd, fname, sizeof(bp->b_cwd));
 		(void)strlcat(bp->b_cwd, "/", sizeof(bp->b_cwd));
 	}
+	if ((s = ffreadinit(&fr, ffp, bp)) != FIOSUC) {
+		(void)ffclose(ffp, NULL);
+		goto out;
+	}
 	opos = curwp->w_doto;
 	oline = curwp->w_dotline;
 	/*
@@ -367,24 +364,28 @@ insertfile(char *fname, char *newname, int replacebuf)
 	olp = lback(curwp->w_dotp);
 	undo_enable(FFRAND, x2);
 
+	/*
+	 * Link each line in ahead of dot as it is read.  The text is
+	 * taken straight from the reader's block buffer by blfile().  The
+	 * position index is rebuilt afterwards rather than line by line.
+	 */
+	lidxinval(bp);
 	nline = 0;
 	siz = 0;
-	while ((s = ffgetline(ffp, line, linesize, &nbytes)) != FIOERR) {
-retry:
-		siz += nbytes + 1;
+	while ((s = ffreadline(&fr, &line, &nbytes)) != FIOERR) {
 		switch (s) {
 		case FIOSUC:
 			/* FALLTHRU */
 		case FIOEOF:
+			siz += nbytes + 1;
 			++nline;
-			if ((lp1 = lalloc(nbytes)) == NULL) {
+			if ((lp1 = blfile(bp, line, nbytes)) == NULL) {
 				/* keep message on the display */
 				s = FIOERR;
 				undo_add_insert(olp, opos,
 				    siz - nbytes - 1 - 1);
 				goto endoffile;
 			}
-			bcopy(line, &ltext(lp1)[0], nbytes);
 			lp2 = lback(curwp->w_dotp);
 			lp2->l_fp = lp1;
 			lp1->l_fp = curwp->w_dotp;
@@ -395,31 +396,14 @@ retry:
 				goto endoffile;
 			}
 			break;
-		case FIOLONG: {
-				/* a line too long to fit in our buffer */
-				char	*cp;
-				int	newsize;
-
-				newsize = linesize * 2;
-				if (newsize < 0 ||
-				    (cp = malloc(newsize)) == NULL) {
-					dobeep();
-					ewprintf("Could not allocate %d bytes",
-					    newsize);
-					s = FIOERR;
-					goto endoffile;
-				}
-				bcopy(line, cp, linesize);
-				free(line);
-				line = cp;
-				s = ffgetline(ffp, line + linesize, linesize,
-				    &nbytes);
-				nbytes += linesize;
-				linesize = newsize;
-				if (s == FIOERR)
-					goto endoffile;
-				goto retry;
-			}
+		case FIOLONG:
+			/* a line too long to fit in a struct line */
+			dobeep();
+			ewprintf("Line %d too long", nline + 1);
+			s = FIOERR;
+			if (siz != 0)
+				undo_add_insert(olp, opos, siz - 1);
+			goto endoffile;
 		default:
 			dobeep();
 			ewprintf("Unknown code %d reading file", s);
@@ -428,6 +412,7 @@ retry:
 		}
 	}
 endoffile:
+	ffreadfree(&fr);
 	/* ignore errors */
 	(void)ffclose(ffp, NULL);
 	/* don't zap an error */
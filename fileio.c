@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <dirent.h>
 #include <errno.h>
@@ -35,11 +36,46 @@
 #define DEFFILEMODE 0666
 #endif
 
+#define FFBLKSIZ	(64 * 1024)	/* Initial file read block size */
+#define FFIOVCNT	128		/* Pieces per writev()		*/
+#define FFCOPYMAX	512		/* Stage pieces shorter than this */
+
+/*
+ * Write gatherer for ffputbuf().  Short pieces are copied together
+ * into a staging block and long ones are written from where they lie;
+ * both go out with writev() up to FFIOVCNT pieces at a time.
+ */
+struct ffwriter {
+	int		 fw_fd;
+	int		 fw_error;
+	int		 fw_niov;
+	size_t		 fw_staged;
+	struct iovec	 fw_iov[FFIOVCNT];
+	char		 fw_stage[FFBLKSIZ];
+};
+
+static int   ffwflush(struct ffwriter *);
+static int   ffwrite(struct ffwriter *, const char *, size_t);
+static int   ffatomic(const char *, struct stat *);
+static int   ffcopyfd(int, int);
+
 static char *bkuplocation(const char *);
 static int   bkupleavetmp(const char *);
 
 static char *bkupdir;
 static int   leavetmp = 0;	/* 1 = leave any '~' files in tmp dir */
+static int   fsyncsave = 0;	/* 1 = fsync() files after writing */
+static int   atomicsave = 0;	/* 1 = save by renaming a new file */
+static struct ffwriter ffw;
+
+/*
+ * State of an atomic save, from ffwopen() to ffclose(), and the inode
+ * fbackupfile() last linked a backup to.
+ */
+static FILE  *ffwfp;
+static char  *ffwname, *ffwtemp;
+static dev_t  bklinkdev;
+static ino_t  bklinkino;
 
 /*
  * Open a file for reading.
@@ -101,31 +137,54 @@ fupdstat(struct buffer *bp)
 }
 
 /*
- * Open a file for writing.
+ * Open a file for writing.  With atomic-save, and if ffatomic() agrees,
+ * a new file is created next to it instead, which ffclose() renames
+ * over the old one once it has all been written.
  */
 int
 ffwopen(FILE ** ffp, const char *fn, struct buffer *bp)
 {
+	struct stat	sb;
 	int	fd;
 	mode_t	fmode = DEFFILEMODE;
 
 	if (bp && bp->b_fi.fi_mode)
 		fmode = bp->b_fi.fi_mode & 07777;
 
-	fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, fmode);
+	ffw.fw_error = 0;
+	if (ffatomic(fn, &sb)) {
+		if ((ffwname = strdup(fn)) == NULL ||
+		    asprintf(&ffwtemp, "%s.XXXXXXXXXX", fn) == -1) {
+			free(ffwname);
+			ffwname = ffwtemp = NULL;
+			dobeep();
+			ewprintf("Can't allocate temp file name : %s",
+			    strerror(errno));
+			return (FIOERR);
+		}
+		if ((fd = mkstemp(ffwtemp)) != -1) {
+			(void)fchmod(fd, sb.st_mode & 07777);
+			(void)fchown(fd, sb.st_uid, sb.st_gid);
+		}
+	} else
+		fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, fmode);
 	if (fd == -1) {
 		ffp = NULL;
 		dobeep();
 		ewprintf("Cannot open file for writing : %s", strerror(errno));
-		return (FIOERR);
+		goto err;
 	}
 
 	if ((*ffp = fdopen(fd, "w")) == NULL) {
 		dobeep();
 		ewprintf("Cannot open file for writing : %s", strerror(errno));
 		close(fd);
-		return (FIOERR);
+		if (ffwtemp != NULL)
+			(void)unlink(ffwtemp);
+		goto err;
 	}
+	if (ffwtemp != NULL)
+		ffwfp = *ffp;
 
 	/*
 	 * If we have file information, use it.  We don't bother to check for
@@ -139,43 +198,181 @@ ffwopen(FILE ** ffp, const char *fn, struct buffer *bp)
 		fchown(fd, bp->b_fi.fi_uid, bp->b_fi.fi_gid);
 	}
 	return (FIOSUC);
+err:
+	free(ffwname);
+	free(ffwtemp);
+	ffwname = ffwtemp = NULL;
+	return (FIOERR);
 }
 
 /*
- * Close a file.
+ * Close a file.  If it is the new file of an atomic save, rename it
+ * into place, or remove it if anything went wrong writing it.
  */
 int
 ffclose(FILE *ffp, struct buffer *bp)
 {
-	if (fclose(ffp) == 0)
-		return (FIOSUC);
-	return (FIOERR);
+	int	s;
+
+	s = (fclose(ffp) == 0) ? FIOSUC : FIOERR;
+	if (ffp != ffwfp)
+		return (s);
+	if (s == FIOSUC && ffw.fw_error)
+		s = FIOERR;
+	if (s == FIOSUC && rename(ffwtemp, ffwname) == -1) {
+		dobeep();
+		ewprintf("Can't rename temp : %s", strerror(errno));
+		s = FIOERR;
+	}
+	if (s != FIOSUC)
+		(void)unlink(ffwtemp);
+	free(ffwname);
+	free(ffwtemp);
+	ffwname = ffwtemp = NULL;
+	ffwfp = NULL;
+	return (s);
+}
+
+/*
+ * Return TRUE if file "fn" should be saved atomically: atomic-save is
+ * on, and the file is a plain file of ours, in a directory we can
+ * write to, with no other links (except a backup fbackupfile() has
+ * just made).  Otherwise it is rewritten in place, which keeps its
+ * inode, links, owner and any open descriptors on it.  The stat of
+ * the file is left in sb.
+ */
+static int
+ffatomic(const char *fn, struct stat *sb)
+{
+	char	 dir[NFILEN], *cp;
+
+	if (!atomicsave || stat(fn, sb) == -1 || !S_ISREG(sb->st_mode))
+		return (FALSE);
+	if (sb->st_uid != geteuid() && geteuid() != 0)
+		return (FALSE);
+	if (sb->st_nlink != 1 && !(sb->st_nlink == 2 &&
+	    sb->st_dev == bklinkdev && sb->st_ino == bklinkino))
+		return (FALSE);
+	if (strlcpy(dir, fn, sizeof(dir)) >= sizeof(dir))
+		return (FALSE);
+	if ((cp = strrchr(dir, '/')) == NULL)
+		(void)strlcpy(dir, ".", sizeof(dir));
+	else if (cp == dir)
+		dir[1] = '\0';
+	else
+		*cp = '\0';
+	return (access(dir, W_OK) == 0);
 }
 
 /*
  * Write a buffer to the already opened file. bp points to the
- * buffer. Return the status.
+ * buffer. Return the status.  Runs of lines that are still as they
+ * were read, one after the other in a file block, go out in one piece.
+ * The lines and newlines are gathered into a few large writev() calls
+ * on the file descriptor rather than going through stdio.
  */
 int
 ffputbuf(FILE *ffp, struct buffer *bp, int eobnl)
 {
+	struct ffwriter	*fw = &ffw;
 	struct line	*lp, *lpend;
+	char		*cp;
+	size_t		 len;
 
 	lpend = bp->b_headp;
+	fw->fw_fd = fileno(ffp);
+	fw->fw_niov = 0;
+	fw->fw_staged = 0;
 
 	for (lp = lforw(lpend); lp != lpend; lp = lforw(lp)) {
-		if (fwrite(ltext(lp), 1, llength(lp), ffp) != llength(lp)) {
-			dobeep();
-			ewprintf("Write I/O error");
-			return (FIOERR);
-		}
-		if (lforw(lp) != lpend)		/* no implied \n on last line */
-			putc(*bp->b_nlchr, ffp);
+		cp = ltext(lp);
+		while (lforw(lp) != lpend && lfiletext(lp) &&
+		    lfiletext(lforw(lp)) &&
+		    ltext(lforw(lp)) == ltext(lp) + llength(lp) + 1 &&
+		    ltext(lp)[llength(lp)] == *bp->b_nlchr)
+			lp = lforw(lp);
+		len = ltext(lp) + llength(lp) - cp;
+		if (ffwrite(fw, cp, len) == FIOERR)
+			goto err;
+		if (lforw(lp) != lpend &&	/* no implied \n on last line */
+		    ffwrite(fw, bp->b_nlchr, 1) == FIOERR)
+			goto err;
 	}
 	if (eobnl) {
 		lnewline_at(lback(lpend), llength(lback(lpend)));
-		putc(*bp->b_nlchr, ffp);
+		if (ffwrite(fw, bp->b_nlchr, 1) == FIOERR)
+			goto err;
 	}
+	if (ffwflush(fw) == FIOERR)
+		goto err;
+	if (fsyncsave && fsync(fw->fw_fd) == -1)
+		goto err;
+	return (FIOSUC);
+err:
+	fw->fw_error = 1;
+	dobeep();
+	ewprintf("Write I/O error");
+	return (FIOERR);
+}
+
+/*
+ * Add "len" bytes at "cp" to the pieces waiting to be written,
+ * flushing first if there is no room.
+ */
+static int
+ffwrite(struct ffwriter *fw, const char *cp, size_t len)
+{
+	struct iovec	*iov;
+
+	if (len == 0)
+		return (FIOSUC);
+	if (fw->fw_niov == FFIOVCNT || (len < FFCOPYMAX &&
+	    fw->fw_staged + len > sizeof(fw->fw_stage)))
+		if (ffwflush(fw) == FIOERR)
+			return (FIOERR);
+	if (len < FFCOPYMAX) {
+		cp = memcpy(fw->fw_stage + fw->fw_staged, cp, len);
+		fw->fw_staged += len;
+	}
+	/* extend the last piece if this one follows on from it */
+	if (fw->fw_niov > 0) {
+		iov = &fw->fw_iov[fw->fw_niov - 1];
+		if ((char *)iov->iov_base + iov->iov_len == cp) {
+			iov->iov_len += len;
+			return (FIOSUC);
+		}
+	}
+	iov = &fw->fw_iov[fw->fw_niov++];
+	iov->iov_base = (void *)cp;
+	iov->iov_len = len;
+	return (FIOSUC);
+}
+
+/*
+ * Write out all waiting pieces, coping with short writes.
+ */
+static int
+ffwflush(struct ffwriter *fw)
+{
+	struct iovec	*iov = fw->fw_iov;
+	int		 niov = fw->fw_niov;
+	ssize_t		 n;
+
+	while (niov > 0) {
+		if ((n = writev(fw->fw_fd, iov, niov)) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return (FIOERR);
+		}
+		for (; niov > 0 && (size_t)n >= iov->iov_len; iov++, niov--)
+			n -= iov->iov_len;
+		if (niov > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	fw->fw_niov = 0;
+	fw->fw_staged = 0;
 	return (FIOSUC);
 }
 
@@ -206,6 +403,150 @@ ffgetline(FILE *ffp, char *buf, int nbuf, int *nbytes)
 	return (c == EOF ? FIOEOF : FIOSUC);
 }
 
+/*
+ * Prepare to read the lines of an open file into buffer bp a block at
+ * a time.  Bytes are read straight into one buffer, which only grows
+ * if a single line does not fit in it, and each line is found with
+ * memchr() instead of a getc() per byte.
+ *
+ * With FILEBLOCK the blocks are allocated from the buffer with
+ * latext() and kept, so that its lines can point into them.  The
+ * first block is then made big enough for the whole file.
+ */
+int
+ffreadinit(struct ffreader *fr, FILE *ffp, struct buffer *bp)
+{
+	size_t	size = FFBLKSIZ;
+#ifdef FILEBLOCK
+	struct stat	sb;
+
+	if (fstat(fileno(ffp), &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    sb.st_size >= FFBLKSIZ && sb.st_size < SSIZE_MAX)
+		size = sb.st_size + 1;
+#endif /* FILEBLOCK */
+
+	memset(fr, 0, sizeof(*fr));
+	fr->fr_bp = bp;
+#ifdef FILEBLOCK
+	fr->fr_buf = latext(bp, size);
+#else
+	fr->fr_buf = malloc(size);
+#endif /* FILEBLOCK */
+	if (fr->fr_buf == NULL) {
+		dobeep();
+		ewprintf("Could not allocate %ld bytes", (long)size);
+		return (FIOERR);
+	}
+	fr->fr_size = size;
+	fr->fr_fp = ffp;
+	fr->fr_nlchr = *bp->b_nlchr;
+	return (FIOSUC);
+}
+
+/*
+ * Return the next line of the file in *linep, without its newline.
+ * The text stays in the reader's buffer and is only valid until the
+ * next call. As with ffgetline(), FIOEOF means *linep holds the final
+ * line of the file, which has no newline after it (and may be empty).
+ * FIOLONG is returned if a line is too long to fit in a struct line.
+ */
+int
+ffreadline(struct ffreader *fr, char **linep, int *nbytes)
+{
+	char	*cp, *nbuf;
+	size_t	 nread, nsize;
+
+	for (;;) {
+		if ((cp = memchr(fr->fr_buf + fr->fr_scan, fr->fr_nlchr,
+		    fr->fr_len - fr->fr_scan)) != NULL) {
+			*linep = fr->fr_buf + fr->fr_pos;
+			*nbytes = cp - *linep;
+			fr->fr_pos = fr->fr_scan = cp - fr->fr_buf + 1;
+			return (FIOSUC);
+		}
+		fr->fr_scan = fr->fr_len;
+		if (fr->fr_len - fr->fr_pos >= INT_MAX) {
+			*linep = fr->fr_buf + fr->fr_pos;
+			*nbytes = INT_MAX;
+			return (FIOLONG);
+		}
+		if (fr->fr_eof) {
+			*linep = fr->fr_buf + fr->fr_pos;
+			*nbytes = fr->fr_len - fr->fr_pos;
+			fr->fr_pos = fr->fr_len;
+			return (FIOEOF);
+		}
+
+#ifdef FILEBLOCK
+		/*
+		 * Lines already read point into this block, so carry the
+		 * partial line over to a new one instead.
+		 */
+		if (fr->fr_pos != 0 || fr->fr_len == fr->fr_size) {
+			nsize = fr->fr_size;
+			if (fr->fr_len - fr->fr_pos > nsize / 2)
+				nsize *= 2;
+			if ((nbuf = latext(fr->fr_bp, nsize)) == NULL) {
+				dobeep();
+				ewprintf("Could not allocate %ld bytes",
+				    (long)nsize);
+				return (FIOERR);
+			}
+			memcpy(nbuf, fr->fr_buf + fr->fr_pos,
+			    fr->fr_len - fr->fr_pos);
+			fr->fr_buf = nbuf;
+			fr->fr_size = nsize;
+			fr->fr_len -= fr->fr_pos;
+			fr->fr_scan = fr->fr_len;
+			fr->fr_pos = 0;
+		}
+#else
+		/* Move the partial line down, or make room for more. */
+		if (fr->fr_pos != 0) {
+			memmove(fr->fr_buf, fr->fr_buf + fr->fr_pos,
+			    fr->fr_len - fr->fr_pos);
+			fr->fr_len -= fr->fr_pos;
+			fr->fr_scan = fr->fr_len;
+			fr->fr_pos = 0;
+		} else if (fr->fr_len == fr->fr_size) {
+			nsize = fr->fr_size * 2;
+			if ((nbuf = realloc(fr->fr_buf, nsize)) == NULL) {
+				dobeep();
+				ewprintf("Could not allocate %ld bytes",
+				    (long)nsize);
+				return (FIOERR);
+			}
+			fr->fr_buf = nbuf;
+			fr->fr_size = nsize;
+		}
+#endif /* FILEBLOCK */
+		nread = fread(fr->fr_buf + fr->fr_len, 1,
+		    fr->fr_size - fr->fr_len, fr->fr_fp);
+		if (nread == 0) {
+			if (ferror(fr->fr_fp)) {
+				dobeep();
+				ewprintf("File read error");
+				return (FIOERR);
+			}
+			fr->fr_eof = 1;
+		}
+		fr->fr_len += nread;
+	}
+}
+
+/*
+ * Release the buffer of a file reader.  With FILEBLOCK it belongs to
+ * the buffer that was read into.
+ */
+void
+ffreadfree(struct ffreader *fr)
+{
+#ifndef FILEBLOCK
+	free(fr->fr_buf);
+#endif /* !FILEBLOCK */
+	fr->fr_buf = NULL;
+}
+
 /*
  * Make a backup copy of "fname".  On Unix the backup has the same
  * name as the original file, with a "~" on the end; this seems to
@@ -221,7 +562,6 @@ fbackupfile(const char *fn)
 	struct timespec	 new_times[2];
 	int		 from, to, serrno;
 	ssize_t		 nread;
-	char		 buf[BUFSIZ];
 	char		*nname, *tname, *bkpth;
 
 	if (stat(fn, &sb) == -1) {
@@ -248,6 +588,27 @@ fbackupfile(const char *fn)
 	}
 	free(bkpth);
 
+	/*
+	 * If the file is going to be replaced rather than rewritten, the
+	 * old one can simply stay on as the backup: link it there.  This
+	 * fails harmlessly if the backup is on another file system.
+	 */
+	if (ffatomic(fn, &sb) && (to = mkstemp(tname)) != -1) {
+		close(to);
+		(void)unlink(tname);
+		if (link(fn, tname) == 0) {
+			if (rename(tname, nname) == 0) {
+				bklinkdev = sb.st_dev;
+				bklinkino = sb.st_ino;
+				free(nname);
+				free(tname);
+				return (TRUE);
+			}
+			(void)unlink(tname);
+		}
+		(void)strlcpy(tname + strlen(tname) - 10, "XXXXXXXXXX", 11);
+	}
+
 	if ((from = open(fn, O_RDONLY)) == -1) {
 		free(nname);
 		free(tname);
@@ -262,12 +623,7 @@ fbackupfile(const char *fn)
 		errno = serrno;
 		return (FALSE);
 	}
-	while ((nread = read(from, buf, sizeof(buf))) > 0) {
-		if (write(to, buf, (size_t)nread) != nread) {
-			nread = -1;
-			break;
-		}
-	}
+	nread = ffcopyfd(from, to);
 	serrno = errno;
 	(void) fchmod(to, (sb.st_mode & 0777));
 
@@ -295,6 +651,32 @@ fbackupfile(const char *fn)
 	return (nread == -1 ? FALSE : TRUE);
 }
 
+/*
+ * Copy the rest of file "from" to file "to".  Where the system can
+ * copy (or share) the blocks itself, let it.  Return -1 on error.
+ */
+static int
+ffcopyfd(int from, int to)
+{
+	char	buf[BUFSIZ];
+	ssize_t	nread;
+
+#ifdef __linux__
+	while ((nread = copy_file_range(from, NULL, to, NULL, 1 << 30, 0)) > 0)
+		;
+	if (nread == 0)
+		return (0);
+	if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+	    errno != EOPNOTSUPP)
+		return (-1);
+#endif /* __linux__ */
+	while ((nread = read(from, buf, sizeof(buf))) > 0) {
+		if (write(to, buf, (size_t)nread) != nread)
+			return (-1);
+	}
+	return (nread == -1 ? -1 : 0);
+}
+
 /*
  * Convert "fn" to a canonicalized absolute filename, replacing
  * a leading ~/ with the user's home dir, following symlinks, and
@@ -673,6 +1055,38 @@ backuptohomedir(int f, int n)
 	return (TRUE);
 }
 
+/*
+ * Toggle whether files are fsync()ed after they are written, so that
+ * a successful save means the data is on disk.
+ */
+int
+fsynconsave(int f, int n)
+{
+	if (f & FFARG)
+		fsyncsave = n > 0;
+	else
+		fsyncsave = !fsyncsave;
+	ewprintf("Fsync on save %sabled", fsyncsave ? "en" : "dis");
+	return (TRUE);
+}
+
+/*
+ * Toggle atomic saving: write a new file next to the old one and
+ * rename it into place, so that the file is never seen half written.
+ * Off by default, since programs like crontab(1) and vipw(8) expect
+ * their file to be edited in place.
+ */
+int
+toggleatomicsave(int f, int n)
+{
+	if (f & FFARG)
+		atomicsave = n > 0;
+	else
+		atomicsave = !atomicsave;
+	ewprintf("Atomic save %sabled", atomicsave ? "en" : "dis");
+	return (TRUE);
+}
+
 /*
  * For applications that use mg as the editor and have a desire to keep
  * '~' files in /tmp, toggle the location: /tmp | ~/.mg.d
@@ -42,6 +42,7 @@ static struct funmap *funs;
  */
 static struct funmap functnames[] = {
 	{apropos_command, "apropos", 1},
+	{toggleatomicsave, "atomic-save", 0},
 	{toggleaudiblebell, "audible-bell", 0},
 	{auto_execute, "auto-execute", 2},
 	{fillmode, "auto-fill-mode", 0},
@@ -55,6 +56,7 @@ static struct funmap functnames[] = {
 	{gotobob, "beginning-of-buffer", 0},
 	{gotobol, "beginning-of-line", 0},
 	{showmatch, "blink-and-insert", 1},		/* startup only	*/
+	{bpaste, "bracketed-paste", 0},
 	{bsmap, "bsmap-mode", 0},
 	{NULL, "c-x 4 prefix", 0},			/* internal	*/
 	{NULL, "c-x prefix", 0},			/* internal	*/
@@ -120,6 +122,7 @@ static struct funmap functnames[] = {
 	{forwchar, "forward-char", 1},
 	{gotoeop, "forward-paragraph", 1},
 	{forwword, "forward-word", 1},
+	{fsynconsave, "fsync-on-save", 0},
 	{bindtokey, "global-set-key", 2},
 	{unbindtokey, "global-unset-key", 1},
 	{globalwdtoggle, "global-wd-mode", 0},
@@ -206,6 +209,8 @@ static struct funmap functnames[] = {
 	{setcasereplace, "set-case-replace", 0},
 	{set_default_mode, "set-default-mode", 1},
 	{setfillcol, "set-fill-column", 1},
+	{setframeinterval, "set-frame-interval", 1},
+	{setkillringlen, "set-kill-ring-length", 1},
 	{setmark, "set-mark-command", 0},
 	{setprefix, "set-prefix-string", 1},
 	{shellcommand, "shell-command", 1},
@@ -217,6 +222,7 @@ static struct funmap functnames[] = {
 	{spawncli, "suspend-emacs", 0},
 	{usebuffer, "switch-to-buffer", 1},
 	{poptobuffer, "switch-to-buffer-other-window", 1},
+	{syncouttoggle, "synchronized-output-mode", 0},
 	{togglereadonly, "toggle-read-only", 0},
 	{togglereadonlyall, "toggle-read-only-all", 0},
 	{twiddle, "transpose-chars", 0},
@@ -227,6 +233,7 @@ static struct funmap functnames[] = {
 	{undo_boundary_enable, "undo-boundary-toggle", 0},
 	{undo_enable, "undo-enable", 0},
 	{undo_dump, "undo-list", 0},
+	{undo_redo, "undo-redo", 0},
 	{universal_argument, "universal-argument", 1},
 	{upperregion, "upcase-region", 0},
 	{upperword, "upcase-word", 1},
@@ -235,6 +242,7 @@ static struct funmap functnames[] = {
 	{showcpos, "what-cursor-position", 0},
 	{filewrite, "write-file", 1},
 	{yank, "yank", 1},
+	{yankpop, "yank-pop", 1},
 	{NULL, NULL, 0}
 };
 
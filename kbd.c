@@ -79,6 +79,8 @@ getkey(int flag)
 {
 	int	 c;
 
+	if (!pushed)
+		idleupdate();
 	if (flag && !pushed) {
 		if (prompt[0] != '\0' && ttwait(2000)) {
 			/* avoid problems with % */
@@ -94,15 +96,16 @@ getkey(int flag)
 		c = pushedc;
 		pushed = FALSE;
 	} else
-		c = ttgetc();
+		c = ttykbdgetc();
 
-	if (bs_map) {
+	/* Pasted text is text, not keys. */
+	if (bs_map && !inpaste) {
 		if (c == CCHR('H'))
 			c = CCHR('?');
 		else if (c == CCHR('?'))
 			c = CCHR('H');
 	}
-	if (use_metakey && (c & METABIT)) {
+	if (use_metakey && !inpaste && (c & METABIT)) {
 		pushedc = c & ~METABIT;
 		pushed = TRUE;
 		c = CCHR('[');
@@ -152,9 +155,13 @@ doin(void)
 	*(promptp = prompt) = '\0';
 	curmap = curbp->b_modes[curbp->b_nmodes]->p_map;
 	key.k_count = 0;
-	while ((funct = doscan(curmap, (key.k_chars[key.k_count++] =
-	    getkey(TRUE)), &curmap)) == NULL)
-		/* nothing */;
+	key.k_chars[key.k_count++] = getkey(TRUE);
+	if (inpaste)
+		funct = bpaste;
+	else
+		while ((funct = doscan(curmap, key.k_chars[key.k_count - 1],
+		    &curmap)) == NULL)
+			key.k_chars[key.k_count++] = getkey(TRUE);
 
 #ifdef  MGLOG
 	if (!mglog(funct, curmap))
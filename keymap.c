@@ -289,7 +289,7 @@ static PF metal[] = {
 	backpage,		/* v */
 	copyregion,		/* w */
 	extend,			/* x */
-	rescan,			/* y */
+	yankpop,		/* y */
 	zaptochar,		/* z */
 	gotobop,		/* { */
 	piperegion,		/* | */
@@ -27,7 +27,8 @@
 
 #include "def.h"
 
-int	casereplace = TRUE;
+int		casereplace = TRUE;
+unsigned int	lgen;		/* Last change stamp handed out */
 
 /*
  * Preserve the case of the replaced string.
@@ -55,8 +56,10 @@ lalloc(int used)
 	if ((lp = malloc(sizeof(*lp))) == NULL)
 		return (NULL);
 	lp->l_text = NULL;
+	lp->l_chunk = NULL;
 	lp->l_size = 0;
 	lp->l_used = used;	/* XXX */
+	ltouch(lp);
 	if (lrealloc(lp, used) == FALSE) {
 		free(lp);
 		return (NULL);
@@ -79,15 +82,207 @@ lrealloc(struct line *lp, int newsize)
 }
 
 /*
- * Delete line "lp".  Fix all of the links that might point to it (they are
- * moved to offset 0 of the next line.  Unlink the line from whatever buffer
- * it might be in, and release the memory.  The buffers are updated too; the
- * magic conditions described in the above comments don't hold here.
+ * Arena storage for the lines of a buffer.  Pieces are handed out of
+ * LA_BLKSIZE blocks in multiples of LA_GRAIN bytes; a line header is
+ * one piece and a line's text is another, if it is no longer than
+ * LA_MAXCHUNK.  Longer text is malloc()ed as before.  Whether text
+ * belongs to the arena is told by its l_size, which for arena text is
+ * always a size class and never more than LA_MAXCHUNK.  The header line
+ * of a buffer is always malloc()ed, since it outlives the arena.  Text
+ * blocks handed out by latext() for FILEBLOCK go with the arena too.
+ */
+#define LA_BLKSIZE	(64 * 1024)
+#define LA_CLASS(n)	(((n) - 1) / LA_GRAIN)
+#define LA_ROUND(n)	((LA_CLASS(n) + 1) * LA_GRAIN)
+
+struct lablock {
+	struct lablock	*lb_next;
+};
+#define LA_BLKHDR	LA_ROUND(sizeof(struct lablock))
+
+/*
+ * Get a piece of at least "size" bytes, 0 < size <= LA_MAXCHUNK.
+ */
+static void *
+lapiece(struct larena *la, size_t size)
+{
+	struct lablock	*lb;
+	void		**pp;
+	int		 c;
+
+	c = LA_CLASS(size);
+	size = LA_ROUND(size);
+	if ((pp = la->la_free[c]) != NULL) {
+		la->la_free[c] = *pp;
+		la->la_freebytes -= size;
+	} else {
+		if (la->la_left < size) {
+			if ((lb = malloc(LA_BLKSIZE)) == NULL)
+				return (NULL);
+			/* keep the tail of the old block for later */
+			if (la->la_left >= LA_GRAIN) {
+				pp = (void **)la->la_next;
+				c = la->la_left / LA_GRAIN - 1;
+				*pp = la->la_free[c];
+				la->la_free[c] = pp;
+				la->la_freebytes += (c + 1) * LA_GRAIN;
+			}
+			lb->lb_next = la->la_blocks;
+			la->la_blocks = lb;
+			la->la_nblocks++;
+			la->la_next = (char *)lb + LA_BLKHDR;
+			la->la_left = LA_BLKSIZE - LA_BLKHDR;
+		}
+		pp = (void **)la->la_next;
+		la->la_next += size;
+		la->la_left -= size;
+	}
+	la->la_nchunks++;
+	return (pp);
+}
+
+/*
+ * Put a piece back on the free list for its size.
+ */
+static void
+lapiecefree(struct larena *la, void *p, size_t size)
+{
+	int	c;
+
+	c = LA_CLASS(size);
+	*(void **)p = la->la_free[c];
+	la->la_free[c] = p;
+	la->la_freebytes += LA_ROUND(size);
+	la->la_nchunks--;
+}
+
+/*
+ * Allocate a new line of size `used' from the arena of buffer bp.
+ * blrealloc() can be called if the line ever needs to grow beyond
+ * that, and blfree() releases it.
+ */
+struct line *
+blalloc(struct buffer *bp, int used)
+{
+	struct line *lp;
+
+	if ((lp = lapiece(&bp->b_arena, sizeof(*lp))) == NULL)
+		return (NULL);
+	lp->l_text = NULL;
+	lp->l_chunk = NULL;
+	lp->l_size = 0;
+	lp->l_used = used;	/* XXX */
+	ltouch(lp);
+	if (blrealloc(bp, lp, used) == FALSE) {
+		lapiecefree(&bp->b_arena, lp, sizeof(*lp));
+		return (NULL);
+	}
+	return (lp);
+}
+
+int
+blrealloc(struct buffer *bp, struct line *lp, int newsize)
+{
+	char	*tmp;
+	int	 size, len;
+
+	if (lp->l_size >= newsize)
+		return (TRUE);
+	if (lp == bp->b_headp || lp->l_size > LA_MAXCHUNK)
+		return (lrealloc(lp, newsize));
+
+	if (newsize <= LA_MAXCHUNK) {
+		size = LA_ROUND(newsize);
+		tmp = lapiece(&bp->b_arena, size);
+	} else {
+		size = newsize;
+		tmp = malloc(size);
+	}
+	if (tmp == NULL)
+		return (FALSE);
+	if (lp->l_size != 0) {
+		len = lp->l_used < lp->l_size ? lp->l_used : lp->l_size;
+		memcpy(tmp, lp->l_text, len);
+		lapiecefree(&bp->b_arena, lp->l_text, lp->l_size);
+	} else if (lfiletext(lp)) {
+		/* copy the text out of the file block */
+		len = lp->l_used < newsize ? lp->l_used : newsize;
+		memcpy(tmp, lp->l_text, len);
+	}
+	lp->l_text = tmp;
+	lp->l_size = size;
+	return (TRUE);
+}
+
+/*
+ * Allocate a new line of buffer bp holding the "len" bytes at "text",
+ * as returned by ffreadline().  Normally the text is copied.  With
+ * FILEBLOCK the reader's blocks belong to the buffer, so the line just
+ * points into them; the text is only copied, by blrealloc(), when the
+ * line has to grow.
+ */
+struct line *
+blfile(struct buffer *bp, char *text, int len)
+{
+	struct line *lp;
+
+#ifdef FILEBLOCK
+	if ((lp = blalloc(bp, 0)) == NULL)
+		return (NULL);
+	lp->l_text = text;
+	lp->l_used = len;
+#else
+	if ((lp = blalloc(bp, len)) == NULL)
+		return (NULL);
+	if (len != 0)
+		memcpy(ltext(lp), text, len);
+#endif
+	return (lp);
+}
+
+/*
+ * Allocate a block of "size" bytes for the text of a file being read
+ * into buffer bp.  It is released with the rest of the arena.
+ */
+char *
+latext(struct buffer *bp, size_t size)
+{
+	struct larena	*la = &bp->b_arena;
+	struct lablock	*lb;
+
+	if ((lb = malloc(LA_BLKHDR + size)) == NULL)
+		return (NULL);
+	lb->lb_next = la->la_texts;
+	la->la_texts = lb;
+	return ((char *)lb + LA_BLKHDR);
+}
+
+/*
+ * Release the storage of line "lp" of buffer bp.  The line must
+ * already be unlinked, and nothing may point at it.
  */
 void
-lfree(struct line *lp)
+blfree(struct buffer *bp, struct line *lp)
+{
+	if (lp == bp->b_headp || lp->l_size > LA_MAXCHUNK)
+		free(lp->l_text);
+	else if (lp->l_size != 0)
+		lapiecefree(&bp->b_arena, lp->l_text, lp->l_size);
+	if (lp == bp->b_headp)
+		free(lp);
+	else
+		lapiecefree(&bp->b_arena, lp, sizeof(*lp));
+}
+
+/*
+ * Delete line "lp" of buffer bp.  Fix all of the links that might point
+ * to it (they are moved to offset 0 of the next line.  Unlink the line
+ * from the buffer, and release the memory.  The buffers are updated too;
+ * the magic conditions described in the above comments don't hold here.
+ */
+void
+lfree(struct buffer *bp, struct line *lp)
 {
-	struct buffer	*bp;
 	struct mgwin	*wp;
 
 	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
@@ -102,22 +297,505 @@ lfree(struct line *lp)
 			wp->w_marko = 0;
 		}
 	}
-	for (bp = bheadp; bp != NULL; bp = bp->b_bufp) {
-		if (bp->b_nwnd == 0) {
-			if (bp->b_dotp == lp) {
-				bp->b_dotp = lp->l_fp;
-				bp->b_doto = 0;
-			}
-			if (bp->b_markp == lp) {
-				bp->b_markp = lp->l_fp;
-				bp->b_marko = 0;
-			}
+	if (bp->b_nwnd == 0) {
+		if (bp->b_dotp == lp) {
+			bp->b_dotp = lp->l_fp;
+			bp->b_doto = 0;
+		}
+		if (bp->b_markp == lp) {
+			bp->b_markp = lp->l_fp;
+			bp->b_marko = 0;
 		}
 	}
+	lidxunlink(bp, lp);
 	lp->l_bp->l_fp = lp->l_fp;
 	lp->l_fp->l_bp = lp->l_bp;
-	free(lp->l_text);
-	free(lp);
+	blfree(bp, lp);
+}
+
+/*
+ * Delete every line of buffer bp but the header line, giving the
+ * arena back in one go. Dot and mark of the buffer and of any window
+ * on it are left on the header line.
+ */
+void
+lfreeall(struct buffer *bp)
+{
+	struct larena	*la = &bp->b_arena;
+	struct lablock	*lb;
+	struct line	*lp;
+	struct mgwin	*wp;
+
+	for (lp = lforw(bp->b_headp); lp != bp->b_headp; lp = lforw(lp))
+		if (lp->l_size > LA_MAXCHUNK)
+			free(lp->l_text);
+	bp->b_headp->l_fp = bp->b_headp;
+	bp->b_headp->l_bp = bp->b_headp;
+
+	while ((lb = la->la_blocks) != NULL) {
+		la->la_blocks = lb->lb_next;
+		free(lb);
+	}
+	while ((lb = la->la_texts) != NULL) {
+		la->la_texts = lb->lb_next;
+		free(lb);
+	}
+	memset(la, 0, sizeof(*la));
+	lidxfree(bp);
+
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp != bp)
+			continue;
+		wp->w_linep = wp->w_dotp = bp->b_headp;
+		wp->w_doto = 0;
+		wp->w_rflag |= WFFULL;
+		if (wp->w_markp != NULL) {
+			wp->w_markp = bp->b_headp;
+			wp->w_marko = 0;
+		}
+	}
+	bp->b_dotp = bp->b_headp;
+	bp->b_doto = 0;
+	if (bp->b_markp != NULL) {
+		bp->b_markp = bp->b_headp;
+		bp->b_marko = 0;
+	}
+}
+
+/*
+ * Estimate the memory the arena of buffer bp saves, compared with
+ * malloc()ing every piece separately.  Each malloc() chunk costs two
+ * words of overhead, against which are set the arena's own block
+ * headers and the space it holds free.  A buffer that gains nothing
+ * reports 0.
+ */
+long
+larenasaved(struct buffer *bp)
+{
+	struct larena	*la = &bp->b_arena;
+	long		 saved;
+
+	saved = (long)(la->la_nchunks * 2 * sizeof(size_t)) -
+	    (long)(la->la_freebytes + la->la_left +
+	    la->la_nblocks * LA_BLKHDR);
+	return (saved > 0 ? saved : 0);
+}
+
+/*
+ * Line position index.  The lines of a buffer are split into runs of
+ * at most LIDX_MAX lines, each line pointing at its run, and the byte
+ * and line totals of the runs are kept in two Fenwick trees.  Finding
+ * the position of a line then costs a walk over the part of its run
+ * before it plus a prefix sum over the runs; the reverse descends the
+ * tree and walks one run.  The index is built lazily when first asked
+ * for, and is kept up to date by the line primitives below.  Anything
+ * else that rewires the lines of a buffer must call lidxinval().
+ */
+#define LIDX_RUN	128		/* Lines per run when building	 */
+#define LIDX_MAX	(2 * LIDX_RUN)	/* Split runs longer than this	 */
+
+static void
+lidxadd(struct lindex *li, int i, long bytes, long lines)
+{
+	for (i++; i <= li->li_nchunks; i += i & -i) {
+		li->li_bytes[i] += bytes;
+		li->li_lines[i] += lines;
+	}
+}
+
+/*
+ * Rebuild both trees from the totals of the runs.
+ */
+static void
+lidxtree(struct lindex *li)
+{
+	int	i, j;
+
+	for (i = 1; i <= li->li_nchunks; i++) {
+		li->li_bytes[i] = li->li_chunks[i - 1]->lc_bytes;
+		li->li_lines[i] = li->li_chunks[i - 1]->lc_lines;
+	}
+	for (i = 1; i <= li->li_nchunks; i++) {
+		j = i + (i & -i);
+		if (j <= li->li_nchunks) {
+			li->li_bytes[j] += li->li_bytes[i];
+			li->li_lines[j] += li->li_lines[i];
+		}
+	}
+}
+
+/*
+ * Make room for "n" runs.
+ */
+static int
+lidxgrow(struct lindex *li, int n)
+{
+	struct lchunk	**cp;
+	long		 *bp, *np;
+	int		  size;
+
+	if (n <= li->li_alloc)
+		return (TRUE);
+	size = li->li_alloc ? li->li_alloc : 64;
+	while (size < n)
+		size *= 2;
+	if ((cp = reallocarray(li->li_chunks, size, sizeof(*cp))) == NULL)
+		return (FALSE);
+	li->li_chunks = cp;
+	if ((bp = reallocarray(li->li_bytes, size + 1, sizeof(*bp))) == NULL)
+		return (FALSE);
+	li->li_bytes = bp;
+	if ((np = reallocarray(li->li_lines, size + 1, sizeof(*np))) == NULL)
+		return (FALSE);
+	li->li_lines = np;
+	li->li_alloc = size;
+	return (TRUE);
+}
+
+/*
+ * Insert run "lc" at index "at", and rebuild the trees.
+ */
+static int
+lidxinsert(struct lindex *li, struct lchunk *lc, int at)
+{
+	int	i;
+
+	if (lidxgrow(li, li->li_nchunks + 1) == FALSE)
+		return (FALSE);
+	memmove(&li->li_chunks[at + 1], &li->li_chunks[at],
+	    (li->li_nchunks - at) * sizeof(*li->li_chunks));
+	li->li_chunks[at] = lc;
+	li->li_nchunks++;
+	for (i = at; i < li->li_nchunks; i++)
+		li->li_chunks[i]->lc_idx = i;
+	lidxtree(li);
+	return (TRUE);
+}
+
+/*
+ * Throw the index of buffer bp away; it is rebuilt when next needed.
+ */
+void
+lidxinval(struct buffer *bp)
+{
+	struct lindex	*li = &bp->b_index;
+	int		 i;
+
+	for (i = 0; i < li->li_nchunks; i++)
+		free(li->li_chunks[i]);
+	li->li_nchunks = 0;
+	li->li_valid = FALSE;
+}
+
+/*
+ * Release all memory of the index of buffer bp.
+ */
+void
+lidxfree(struct buffer *bp)
+{
+	struct lindex	*li = &bp->b_index;
+
+	lidxinval(bp);
+	free(li->li_chunks);
+	free(li->li_bytes);
+	free(li->li_lines);
+	memset(li, 0, sizeof(*li));
+}
+
+/*
+ * Build the index of buffer bp from scratch.
+ */
+static int
+lidxbuild(struct buffer *bp)
+{
+	struct lindex	*li = &bp->b_index;
+	struct lchunk	*lc = NULL;
+	struct line	*lp;
+
+	lidxinval(bp);
+	for (lp = bfirstlp(bp); lp != bp->b_headp; lp = lforw(lp)) {
+		if (lc == NULL || lc->lc_lines == LIDX_RUN) {
+			if (lidxgrow(li, li->li_nchunks + 1) == FALSE ||
+			    (lc = malloc(sizeof(*lc))) == NULL) {
+				lidxinval(bp);
+				return (FALSE);
+			}
+			lc->lc_first = lp;
+			lc->lc_idx = li->li_nchunks;
+			lc->lc_lines = 0;
+			lc->lc_bytes = 0;
+			li->li_chunks[li->li_nchunks++] = lc;
+		}
+		lp->l_chunk = lc;
+		lc->lc_lines++;
+		lc->lc_bytes += llength(lp) + 1;
+	}
+	if (lidxgrow(li, 1) == FALSE) {
+		lidxinval(bp);
+		return (FALSE);
+	}
+	lidxtree(li);
+	li->li_valid = TRUE;
+	return (TRUE);
+}
+
+/*
+ * Split run "lc" in two halves.
+ */
+static void
+lidxsplit(struct buffer *bp, struct lchunk *lc)
+{
+	struct lchunk	*nc;
+	struct line	*lp;
+	int		 i;
+
+	if ((nc = malloc(sizeof(*nc))) == NULL) {
+		lidxinval(bp);
+		return;
+	}
+	for (lp = lc->lc_first, i = lc->lc_lines / 2; i > 0; i--)
+		lp = lforw(lp);
+	nc->lc_first = lp;
+	nc->lc_lines = lc->lc_lines - lc->lc_lines / 2;
+	nc->lc_bytes = 0;
+	for (i = nc->lc_lines; i > 0; i--, lp = lforw(lp)) {
+		lp->l_chunk = nc;
+		nc->lc_bytes += llength(lp) + 1;
+	}
+	lc->lc_lines -= nc->lc_lines;
+	lc->lc_bytes -= nc->lc_bytes;
+	if (lidxinsert(&bp->b_index, nc, lc->lc_idx + 1) == FALSE) {
+		free(nc);
+		lidxinval(bp);
+	}
+}
+
+/*
+ * Line "lp" has just been linked into buffer bp.  It joins the run of
+ * the line before it or, if it is the first line, of the line after.
+ */
+void
+lidxlink(struct buffer *bp, struct line *lp)
+{
+	struct lindex	*li = &bp->b_index;
+	struct lchunk	*lc;
+
+	if (!li->li_valid)
+		return;
+	if (lback(lp) != bp->b_headp)
+		lc = lback(lp)->l_chunk;
+	else if (lforw(lp) != bp->b_headp) {
+		lc = lforw(lp)->l_chunk;
+		lc->lc_first = lp;
+	} else {
+		if ((lc = malloc(sizeof(*lc))) == NULL) {
+			lidxinval(bp);
+			return;
+		}
+		lc->lc_first = lp;
+		lc->lc_lines = lc->lc_bytes = 0;
+		if (lidxinsert(li, lc, 0) == FALSE) {
+			free(lc);
+			lidxinval(bp);
+			return;
+		}
+	}
+	lp->l_chunk = lc;
+	lc->lc_lines++;
+	lc->lc_bytes += llength(lp) + 1;
+	lidxadd(li, lc->lc_idx, llength(lp) + 1, 1);
+	if (lc->lc_lines > LIDX_MAX)
+		lidxsplit(bp, lc);
+}
+
+/*
+ * Line "lp" of buffer bp is about to be unlinked.  A run left empty
+ * is dropped.
+ */
+void
+lidxunlink(struct buffer *bp, struct line *lp)
+{
+	struct lindex	*li = &bp->b_index;
+	struct lchunk	*lc = lp->l_chunk;
+	int		 i;
+
+	if (!li->li_valid)
+		return;
+	lc->lc_lines--;
+	lc->lc_bytes -= llength(lp) + 1;
+	if (lc->lc_lines > 0) {
+		if (lc->lc_first == lp)
+			lc->lc_first = lforw(lp);
+		lidxadd(li, lc->lc_idx, -(llength(lp) + 1), -1);
+		return;
+	}
+	li->li_nchunks--;
+	for (i = lc->lc_idx; i < li->li_nchunks; i++) {
+		li->li_chunks[i] = li->li_chunks[i + 1];
+		li->li_chunks[i]->lc_idx = i;
+	}
+	free(lc);
+	lidxtree(li);
+}
+
+/*
+ * Line "nlp" takes the place of line "olp" of buffer bp.
+ */
+void
+lidxreplace(struct buffer *bp, struct line *olp, struct line *nlp)
+{
+	struct lchunk	*lc = olp->l_chunk;
+
+	if (!bp->b_index.li_valid)
+		return;
+	nlp->l_chunk = lc;
+	if (lc->lc_first == olp)
+		lc->lc_first = nlp;
+	lidxresize(bp, nlp, llength(nlp) - llength(olp));
+}
+
+/*
+ * The length of line "lp" of buffer bp has changed by "delta".
+ */
+void
+lidxresize(struct buffer *bp, struct line *lp, int delta)
+{
+	if (!bp->b_index.li_valid || lp == bp->b_headp || delta == 0)
+		return;
+	lp->l_chunk->lc_bytes += delta;
+	lidxadd(&bp->b_index, lp->l_chunk->lc_idx, delta, 0);
+}
+
+/*
+ * Find the absolute position of offset "off" in line "lp" of buffer
+ * bp, counting the header line as one byte.  Return FALSE if the index
+ * cannot be used, in which case the caller has to walk the buffer.
+ */
+int
+lidxpos(struct buffer *bp, struct line *lp, int off, int *pos)
+{
+	struct lindex	*li = &bp->b_index;
+	struct lchunk	*lc;
+	struct line	*p;
+	long		 count;
+	int		 i;
+
+	if (lp == bp->b_headp) {
+		*pos = off;
+		return (TRUE);
+	}
+	if (!li->li_valid && lidxbuild(bp) == FALSE)
+		return (FALSE);
+	lc = lp->l_chunk;
+	if (lc == NULL || lc->lc_idx >= li->li_nchunks ||
+	    li->li_chunks[lc->lc_idx] != lc)
+		return (FALSE);
+	count = 1;
+	for (i = lc->lc_idx; i > 0; i -= i & -i)
+		count += li->li_bytes[i];
+	for (p = lc->lc_first, i = 0; p != lp; p = lforw(p)) {
+		if (++i == lc->lc_lines)
+			return (FALSE);
+		count += llength(p) + 1;
+	}
+	*pos = count + off;
+	return (TRUE);
+}
+
+/*
+ * The inverse of lidxpos(): find the line and offset of absolute
+ * position "pos" in buffer bp, and the number of the line, counting
+ * the header line as line 0.  Return FALSE if the index cannot be
+ * used or the position is past the end of the buffer.
+ */
+int
+lidxfind(struct buffer *bp, int pos, struct line **olp, int *offset,
+    int *lnum)
+{
+	struct lindex	*li = &bp->b_index;
+	struct line	*p;
+	long		 rest, lineno;
+	int		 i, step;
+
+	if (pos <= llength(bp->b_headp)) {
+		*olp = bp->b_headp;
+		*offset = pos;
+		*lnum = 0;
+		return (TRUE);
+	}
+	if (!li->li_valid && lidxbuild(bp) == FALSE)
+		return (FALSE);
+	rest = pos - 1;
+	lineno = 1;
+	for (step = 1; step * 2 <= li->li_nchunks; step *= 2)
+		;
+	for (i = 0; step > 0; step /= 2) {
+		if (i + step <= li->li_nchunks &&
+		    li->li_bytes[i + step] <= rest) {
+			i += step;
+			rest -= li->li_bytes[i];
+			lineno += li->li_lines[i];
+		}
+	}
+	if (i == li->li_nchunks)
+		return (FALSE);
+	for (p = li->li_chunks[i]->lc_first; rest > llength(p); p = lforw(p)) {
+		rest -= llength(p) + 1;
+		lineno++;
+	}
+	*olp = p;
+	*offset = rest;
+	*lnum = lineno;
+	return (TRUE);
+}
+
+/*
+ * Return the number of lines in buffer bp, not counting the header
+ * line, or -1 if the index cannot be used.
+ */
+int
+lidxnlines(struct buffer *bp)
+{
+	struct lindex	*li = &bp->b_index;
+	long		 count = 0;
+	int		 i;
+
+	if (!li->li_valid && lidxbuild(bp) == FALSE)
+		return (-1);
+	for (i = li->li_nchunks; i > 0; i -= i & -i)
+		count += li->li_lines[i];
+	return (count);
+}
+
+/*
+ * Return line "n" of buffer bp, counting from 1, or NULL if there is
+ * no such line or the index cannot be used.
+ */
+struct line *
+lidxline(struct buffer *bp, int n)
+{
+	struct lindex	*li = &bp->b_index;
+	struct line	*lp;
+	long		 rest;
+	int		 i, step;
+
+	if (n < 1 || (!li->li_valid && lidxbuild(bp) == FALSE))
+		return (NULL);
+	rest = n - 1;
+	for (step = 1; step * 2 <= li->li_nchunks; step *= 2)
+		;
+	for (i = 0; step > 0; step /= 2) {
+		if (i + step <= li->li_nchunks &&
+		    li->li_lines[i + step] <= rest) {
+			i += step;
+			rest -= li->li_lines[i];
+		}
+	}
+	if (i == li->li_nchunks)
+		return (NULL);
+	for (lp = li->li_chunks[i]->lc_first; rest > 0; rest--)
+		lp = lforw(lp);
+	return (lp);
 }
 
 /*
@@ -125,7 +803,8 @@ lfree(struct line *lp)
  * buffer. It updates all of the required flags in the buffer and window
  * system. The flag used is passed as an argument; if the buffer is being
  * displayed in more than 1 window we change EDIT to HARD. Set MODE if the
- * mode line needs to be updated (the "*" has to be set).
+ * mode line needs to be updated (the "*" has to be set). The line at dot
+ * gets a new change stamp, so redisplay knows to draw it again.
  */
 void
 lchange(int flag)
@@ -137,6 +816,7 @@ lchange(int flag)
 		flag |= WFMODE;
 		curbp->b_flag |= BFCHG;
 	}
+	ltouch(curwp->w_dotp);
 	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
 		if (wp->w_bufp == curbp) {
 			wp->w_rflag |= flag;
@@ -192,7 +872,7 @@ linsert(int n, int c)
 			return (FALSE);
 		}
 		/* allocate a new line */
-		if ((lp2 = lalloc(n)) == NULL)
+		if ((lp2 = blalloc(curbp, n)) == NULL)
 			return (FALSE);
 		/* previous line */
 		lp3 = lp1->l_bp;
@@ -203,6 +883,7 @@ linsert(int n, int c)
 		lp2->l_bp = lp3;
 		for (i = 0; i < n; ++i)
 			lp2->l_text[i] = c;
+		lidxlink(curbp, lp2);
 		for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
 			if (wp->w_linep == lp1)
 				wp->w_linep = lp2;
@@ -219,10 +900,11 @@ linsert(int n, int c)
 	doto = curwp->w_doto;
 
 	if ((lp1->l_used + n) > lp1->l_size) {
-		if (lrealloc(lp1, lp1->l_used + n) == FALSE)
+		if (blrealloc(curbp, lp1, lp1->l_used + n) == FALSE)
 			return (FALSE);
 	}
 	lp1->l_used += n;
+	lidxresize(curbp, lp1, n);
 	if (lp1->l_used != n)
 		memmove(&lp1->l_text[doto + n], &lp1->l_text[doto],
 		    lp1->l_used - n - doto);
@@ -272,12 +954,13 @@ lnewline_at(struct line *lp1, int doto)
 	/* If start of line, allocate a new line instead of copying */
 	if (doto == 0) {
 		/* new first part */
-		if ((lp2 = lalloc(0)) == NULL)
+		if ((lp2 = blalloc(curbp, 0)) == NULL)
 			return (FALSE);
 		lp2->l_bp = lp1->l_bp;
 		lp1->l_bp->l_fp = lp2;
 		lp2->l_fp = lp1;
 		lp1->l_bp = lp2;
+		lidxlink(curbp, lp2);
 		for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
 			if (wp->w_linep == lp1)
 				wp->w_linep = lp2;
@@ -295,15 +978,18 @@ lnewline_at(struct line *lp1, int doto)
 	nlen = llength(lp1) - doto;
 
 	/* new second half line */
-	if ((lp2 = lalloc(nlen)) == NULL)
+	if ((lp2 = blalloc(curbp, nlen)) == NULL)
 		return (FALSE);
 	if (nlen != 0)
 		bcopy(&lp1->l_text[doto], &lp2->l_text[0], nlen);
 	lp1->l_used = doto;
+	ltouch(lp1);
+	lidxresize(curbp, lp1, -nlen);
 	lp2->l_bp = lp1;
 	lp2->l_fp = lp1->l_fp;
 	lp1->l_fp = lp2;
 	lp2->l_fp->l_bp = lp2;
+	lidxlink(curbp, lp2);
 	/* Windows */
 	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
 		if (wp->w_dotp == lp1 && wp->w_doto >= doto) {
@@ -343,6 +1029,145 @@ lnewline(void)
 	return (lnewline_at(curwp->w_dotp, curwp->w_doto));
 }
 
+/*
+ * Insert the "n" bytes at "str" at dot, where each newline character of
+ * the buffer starts a new line.  The text goes into the line list in one
+ * go: the line dot is on keeps what comes before dot followed by the
+ * first line of text, new lines are made for the rest, and the last of
+ * them also takes what came after dot.  Windows are fixed up as for
+ * linsert(), dot is left after the text, and the whole insertion makes a
+ * single undo record.
+ */
+int
+linsert_str(const char *str, int n)
+{
+	struct line	*lp1, *lp2, *next, *head = NULL, *tail = NULL;
+	struct mgwin	*wp;
+	const char	*cp, *nl, *end;
+	int		 doto, dotline, len0, len, tlen, newlen, shift;
+	int		 nlines = 0, s;
+
+	if (n <= 0)
+		return (TRUE);
+
+	if ((s = checkdirty(curbp)) != TRUE)
+		return (s);
+	if (curbp->b_flag & BFREADONLY) {
+		dobeep();
+		ewprintf("Buffer is read only");
+		return (FALSE);
+	}
+
+	lp1 = curwp->w_dotp;
+	doto = curwp->w_doto;
+	end = str + n;
+
+	/* Make the lines after the first, the last taking the text after dot */
+	tlen = lp1 == curbp->b_headp ? 0 : llength(lp1) - doto;
+	nl = memchr(str, *curbp->b_nlchr, n);
+	len0 = len = (nl != NULL ? nl : end) - str;
+	while (nl != NULL) {
+		cp = nl + 1;
+		nl = memchr(cp, *curbp->b_nlchr, end - cp);
+		len = (nl != NULL ? nl : end) - cp;
+		if ((lp2 = blalloc(curbp, nl != NULL ? len : len + tlen)) ==
+		    NULL)
+			goto nomem;
+		if (len > 0)
+			memcpy(lp2->l_text, cp, len);
+		if (nl == NULL && tlen > 0)
+			memcpy(&lp2->l_text[len], &lp1->l_text[doto], tlen);
+		lp2->l_fp = NULL;
+		if (tail != NULL)
+			tail->l_fp = lp2;
+		else
+			head = lp2;
+		tail = lp2;
+		nlines++;
+	}
+
+	/* special case for the end */
+	if (lp1 == curbp->b_headp) {
+		/* now should only happen in empty buffer */
+		if (doto != 0) {
+			dobeep();
+			ewprintf("bug: linsert_str");
+			goto fail;
+		}
+		if ((lp2 = blalloc(curbp, 0)) == NULL)
+			goto nomem;
+		lp2->l_bp = lp1->l_bp;
+		lp1->l_bp->l_fp = lp2;
+		lp2->l_fp = lp1;
+		lp1->l_bp = lp2;
+		lidxlink(curbp, lp2);
+		for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+			if (wp->w_linep == lp1)
+				wp->w_linep = lp2;
+			if (wp->w_dotp == lp1)
+				wp->w_dotp = lp2;
+			if (wp->w_markp == lp1)
+				wp->w_markp = lp2;
+		}
+		lp1 = lp2;
+	}
+
+	/* The first line keeps its head, then the first line of text */
+	newlen = nlines > 0 ? doto + len0 : llength(lp1) + len0;
+	if (newlen > lp1->l_size && blrealloc(curbp, lp1, newlen) == FALSE)
+		goto nomem;
+	lchange(nlines > 0 ? WFFULL : WFEDIT);
+	if (nlines == 0 && tlen > 0)
+		memmove(&lp1->l_text[doto + len0], &lp1->l_text[doto], tlen);
+	if (len0 > 0)
+		memcpy(&lp1->l_text[doto], str, len0);
+	lidxresize(curbp, lp1, newlen - llength(lp1));
+	lp1->l_used = newlen;
+
+	/* Link in the rest */
+	for (lp2 = lp1; head != NULL; lp2 = head, head = next) {
+		next = head->l_fp;
+		head->l_bp = lp2;
+		head->l_fp = lp2->l_fp;
+		lp2->l_fp->l_bp = head;
+		lp2->l_fp = head;
+		lidxlink(curbp, head);
+	}
+	curbp->b_lines += nlines;
+
+	/* Whatever was after dot is now on lp2, "shift" bytes further on */
+	shift = nlines > 0 ? len - doto : len0;
+	dotline = curwp->w_dotline;
+	if (curwp->w_markline > dotline || (curwp->w_markp == lp1 &&
+	    curwp->w_marko > doto))
+		curwp->w_markline += nlines;
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp != curbp)
+			continue;
+		if (wp->w_dotp == lp1 && (wp == curwp || wp->w_doto > doto)) {
+			wp->w_dotp = lp2;
+			wp->w_doto += shift;
+			wp->w_dotline += nlines;
+		} else if (wp->w_dotline > dotline)
+			wp->w_dotline += nlines;
+		if (wp->w_markp == lp1 && wp->w_marko > doto) {
+			wp->w_markp = lp2;
+			wp->w_marko += shift;
+		}
+	}
+	undo_add_insert(lp1, doto, n);
+	return (TRUE);
+nomem:
+	dobeep();
+	ewprintf("Out of memory");
+fail:
+	for (; head != NULL; head = next) {
+		next = head->l_fp;
+		blfree(curbp, head);
+	}
+	return (FALSE);
+}
+
 /*
  * This function deletes "n" bytes, starting at dot. (actually, n+1, as the
  * newline is included) It understands how to deal with end of lines, etc.
@@ -355,27 +1180,25 @@ int
 ldelete(RSIZE n, int kflag)
 {
 	struct line	*dotp;
-	RSIZE		 chunk;
+	RSIZE		 chunk, len;
 	struct mgwin	*wp;
 	int		 doto;
 	char		*cp1, *cp2;
-	size_t		 len;
-	char		*sv = NULL;
-	int		 end;
+	char		*kp = NULL;
 	int		 s;
-	int		 rval = FALSE;
 
 	if ((s = checkdirty(curbp)) != TRUE)
 		return (s);
 	if (curbp->b_flag & BFREADONLY) {
 		dobeep();
 		ewprintf("Buffer is read only");
-		goto out;
+		return (FALSE);
 	}
+	/* The deleted text goes straight into the kill buffer */
 	len = n;
-	if ((sv = calloc(1, len + 1)) == NULL)
-		goto out;
-	end = 0;
+	if (len > 0 && (kflag & (KFORW | KBACK)) &&
+	    (kp = kreserve(len, kflag)) == NULL)
+		return (FALSE);
 
 	undo_add_delete(curwp->w_dotp, curwp->w_doto, n, (kflag & KREG));
 
@@ -384,7 +1207,7 @@ ldelete(RSIZE n, int kflag)
 		doto = curwp->w_doto;
 		/* Hit the end of the buffer */
 		if (dotp == curbp->b_headp)
-			goto out;
+			goto fail;
 		/* Size of the chunk */
 		chunk = dotp->l_used - doto;
 
@@ -393,24 +1216,27 @@ ldelete(RSIZE n, int kflag)
 		/* End of line, merge */
 		if (chunk == 0) {
 			if (dotp == blastlp(curbp))
-				goto out;
+				goto fail;
 			lchange(WFFULL);
 			if (ldelnewline() == FALSE)
-				goto out;
-			end = strlcat(sv, curbp->b_nlchr, len + 1);
+				goto fail;
+			if (kp != NULL)
+				*kp++ = *curbp->b_nlchr;
 			--n;
 			continue;
 		}
 		lchange(WFEDIT);
 		/* Scrunch text */
 		cp1 = &dotp->l_text[doto];
-		memcpy(&sv[end], cp1, chunk);
-		end += chunk;
-		sv[end] = '\0';
+		if (kp != NULL) {
+			memcpy(kp, cp1, chunk);
+			kp += chunk;
+		}
 		for (cp2 = cp1 + chunk; cp2 < &dotp->l_text[dotp->l_used];
 		    cp2++)
 			*cp1++ = *cp2;
 		dotp->l_used -= (int)chunk;
+		lidxresize(curbp, dotp, -(int)chunk);
 		for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
 			if (wp->w_dotp == dotp && wp->w_doto >= doto) {
 				wp->w_doto -= chunk;
@@ -425,12 +1251,117 @@ ldelete(RSIZE n, int kflag)
 		}
 		n -= chunk;
 	}
-	if (kchunk(sv, (RSIZE)len, kflag) != TRUE)
-		goto out;
-	rval = TRUE;
-out:
-	free(sv);
-	return (rval);
+	return (TRUE);
+fail:
+	if (kp != NULL)
+		kunreserve(len, kflag);
+	return (FALSE);
+}
+
+/*
+ * Delete those of the "n" lines from lp on whose entry in "del" is set,
+ * newlines and all; lp is line number lnum.  Each run of such lines is
+ * cut out of the buffer in one go and makes one undo record.  The last
+ * line of the buffer has no newline, so a run that takes it in leaves it
+ * there, empty.  The lines cut out are marked with a negative length and
+ * chained by their first line, so windows can be fixed up and the lines
+ * freed once at the end.  Dot is left at the start of the line after the
+ * last run.
+ */
+int
+ldellines(struct line *lp, int lnum, const char *del, int n)
+{
+	struct line	*first, *prev, *next, *runs = NULL;
+	struct mgwin	*wp;
+	int		 i, size, nlines, empty, s;
+
+	if ((s = checkdirty(curbp)) != TRUE)
+		return (s);
+	if (curbp->b_flag & BFREADONLY) {
+		dobeep();
+		ewprintf("Buffer is read only");
+		return (FALSE);
+	}
+	lchange(WFFULL);
+	undo_boundary_enable(FFRAND, 0);
+	for (i = 0; i < n; i++, lp = lforw(lp), lnum++) {
+		if (!del[i])
+			continue;
+		first = lp;
+		size = 0;
+		nlines = 0;
+		empty = FALSE;
+		for (;;) {
+			if (lforw(lp) == curbp->b_headp) {
+				size += llength(lp);
+				empty = TRUE;
+				break;
+			}
+			size += llength(lp) + 1;
+			nlines++;
+			lp = lforw(lp);
+			if (++i == n || !del[i])
+				break;
+		}
+		/* lp is now the line after the run, or the last line */
+		if (size > 0)
+			undo_add_delete(first, 0, size, FALSE);
+		if (empty) {
+			lidxresize(curbp, lp, -llength(lp));
+			lp->l_used = 0;
+			ltouch(lp);
+		}
+		if (nlines > 0) {
+			prev = lback(first);
+			for (next = first; next != lp; next = lforw(next))
+				lidxunlink(curbp, next);
+			for (next = first; next != lp; next = lforw(next))
+				next->l_used = -1;
+			prev->l_fp = lp;
+			lp->l_bp = prev;
+			first->l_bp = runs;
+			runs = first;
+			curbp->b_lines -= nlines;
+			if (curwp->w_markline >= lnum + nlines)
+				curwp->w_markline -= nlines;
+			else if (curwp->w_markline > lnum)
+				curwp->w_markline = lnum;
+		}
+		curwp->w_dotp = lp;
+		curwp->w_doto = 0;
+		curwp->w_dotline = lnum;
+		curwp->w_rflag |= WFMOVE;
+	}
+	undo_boundary_enable(FFRAND, 1);
+
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp != curbp)
+			continue;
+		while (llength(wp->w_linep) < 0)
+			wp->w_linep = lforw(wp->w_linep);
+		while (llength(wp->w_dotp) < 0) {
+			wp->w_dotp = lforw(wp->w_dotp);
+			wp->w_doto = 0;
+		}
+		if (wp->w_doto > llength(wp->w_dotp))
+			wp->w_doto = llength(wp->w_dotp);
+		if (wp->w_markp == NULL)
+			continue;
+		while (llength(wp->w_markp) < 0) {
+			wp->w_markp = lforw(wp->w_markp);
+			wp->w_marko = 0;
+		}
+		if (wp->w_marko > llength(wp->w_markp))
+			wp->w_marko = llength(wp->w_markp);
+	}
+	for (; runs != NULL; runs = first) {
+		first = lback(runs);
+		for (lp = runs; llength(lp) < 0; lp = next) {
+			next = lforw(lp);
+			blfree(curbp, lp);
+		}
+	}
+	return (TRUE);
 }
 
 /*
@@ -483,16 +1414,21 @@ ldelnewline(void)
 				wp->w_marko += lp1->l_used;
 			}
 		}
+		lidxunlink(curbp, lp2);
 		lp1->l_used += lp2->l_used;
+		ltouch(lp1);
+		lidxresize(curbp, lp1, lp2->l_used);
 		lp1->l_fp = lp2->l_fp;
 		lp2->l_fp->l_bp = lp1;
-		free(lp2);
+		blfree(curbp, lp2);
 		return (TRUE);
 	}
-	if ((lp3 = lalloc(lp1->l_used + lp2->l_used)) == NULL)
+	if ((lp3 = blalloc(curbp, lp1->l_used + lp2->l_used)) == NULL)
 		return (FALSE);
 	bcopy(&lp1->l_text[0], &lp3->l_text[0], lp1->l_used);
 	bcopy(&lp2->l_text[0], &lp3->l_text[lp1->l_used], lp2->l_used);
+	lidxunlink(curbp, lp2);
+	lidxreplace(curbp, lp1, lp3);
 	lp1->l_bp->l_fp = lp3;
 	lp3->l_fp = lp2->l_fp;
 	lp2->l_fp->l_bp = lp3;
@@ -513,8 +1449,8 @@ ldelnewline(void)
 			wp->w_marko += lp1->l_used;
 		}
 	}
-	free(lp1);
-	free(lp2);
+	blfree(curbp, lp1);
+	blfree(curbp, lp2);
 	return (TRUE);
 }
 
@@ -176,7 +176,8 @@ mglog_undo(void)
 		    (rec->type == DELREG) ? "DELREGION":
 		    (rec->type == INSERT) ? "INSERT":
 		    (rec->type == BOUNDARY) ? "----" :
-		    (rec->type == MODIFIED) ? "MODIFIED": "UNKNOWN",
+		    (rec->type == MODIFIED) ? "MODIFIED":
+		    (rec->type == BULK) ? "BULK" : "UNKNOWN",
 		    rec->pos
 		    );
 		if (rec->content) {
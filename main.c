@@ -256,7 +256,7 @@ notnum:
 			do_redraw(0, 0, TRUE);
 			winch_flag = 0;
 		}
-		update(CMODE);
+		schedupdate(CMODE);
 		lastflag = thisflag;
 		thisflag = 0;
 
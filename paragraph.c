@@ -142,7 +142,7 @@ fillpara(int f, int n)
 	if (n == 0)
 		return (TRUE);
 
-	undo_boundary_enable(FFRAND, 0);
+	undo_bulk_begin();
 
 	/* record the pointer to the line just past the EOP */
 	(void)gotoeop(FFRAND, 1);
@@ -252,7 +252,7 @@ fillpara(int f, int n)
 	(void)backchar(FFRAND, 1);
 	retval = TRUE;
 cleanup:
-	undo_boundary_enable(FFRAND, 1);
+	undo_bulk_end();
 	return (retval);
 }
 
@@ -16,10 +16,16 @@
 #ifdef REGEX
 #include <sys/queue.h>
 #include <sys/types.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 
 #include "def.h"
 #include "macro.h"
@@ -132,6 +138,351 @@ re_searchagain(int f, int n)
 static regex_t		regex_buff;
 static regmatch_t	regex_match[RE_NMATCH];
 
+/*
+ * Forward searches run the regex over a window of whole lines copied out
+ * of the buffer, joined by newlines, so a pattern with a newline in it
+ * can match across lines.  The pattern is compiled with REG_NEWLINE, so
+ * everything else still matches within a line as it did when each line
+ * was searched on its own.  A window starts out as small as it can be and
+ * doubles in size, up to RE_WINMAX, each time it fails to hold a match.
+ * Lines that do not contain the literal text every match must start with
+ * are skipped without running the regex.  regex_match[] offsets are
+ * into re_wtext.
+ *
+ * A window is kept for the next search, which can use it as long as the
+ * buffer has not changed and the search starts where the last match
+ * ended.  Replacing a match leaves the text after it as it was, so
+ * re_doreplace() moves the window along past the replacement instead
+ * of letting it go.  A pattern that can span any number of lines needs
+ * a window that runs to the end of the buffer, so this keeps repeated
+ * searches from copying the rest of the buffer each time.
+ */
+#define RE_WINMIN	1024		/* first window that can grow	    */
+#define RE_WINMAX	(1024 * 1024)	/* largest window		    */
+
+static char		*re_wtext;	/* window text			    */
+static size_t		 re_wsize;	/* allocated size of re_wtext	    */
+static struct line	**re_wlines;	/* lines copied into the window	    */
+static int		*re_woffs;	/* where each starts in re_wtext    */
+static int		 re_wnlines;	/* number of lines in the window    */
+static int		 re_walloc;	/* allocated size of the above	    */
+static int		 re_wline;	/* line number of re_wlines[0]	    */
+static int		 re_wfirst;	/* first line still in the buffer   */
+static int		 re_wnext;	/* line where the last match ended  */
+static int		 re_wfrom;	/* text before this is out of date  */
+static struct buffer	*re_wbuf;	/* buffer the window is in step with */
+static unsigned int	 re_wgen;	/* lgen when it was last in step    */
+static int		 re_nl;		/* lines a match spans, -1 if any   */
+static char		 re_lit[NPAT];	/* literal text matches start with  */
+static int		 re_litlen;
+static int		 re_cflags;	/* flags re_pat was compiled with   */
+
+/*
+ * Work out how many newlines a match of re_pat can span and what literal
+ * text every match must start with.  Anything hard to be sure of gives
+ * up: an unbounded span, or no literal.  Besides a newline itself, \s,
+ * \W and bracket lists with [:space:], [:cntrl:] or a range taking in
+ * the newline can match one; lists starting with ^ never do.
+ */
+static void
+re_setpat(void)
+{
+	const char	*p, *cls;
+	int		 nl = 0, unbounded = 0, rep = 0, alt = 0, neg;
+
+	for (p = re_pat; *p != '\0'; p++) {
+		if (*p == '\\' && p[1] != '\0') {
+			if (isdigit((unsigned char)*++p))
+				rep = 1;
+			else if (*p == 's' || *p == 'W')
+				unbounded = 1;
+		} else if (*p == '[') {
+			if ((neg = p[1] == '^'))
+				p++;
+			if (p[1] == ']')
+				p++;
+			while (p[1] != '\0' && *++p != ']') {
+				if (*p == CCHR('J'))
+					unbounded = 1;
+				else if (*p == '[' && p[1] != '\0' &&
+				    strchr(":=.", p[1]) != NULL) {
+					/* [:class:], [=equiv=] or [.coll.] */
+					cls = p + 2;
+					for (p = cls; *p != '\0' &&
+					    (*p != cls[-1] || p[1] != ']'); p++)
+						if (*p == CCHR('J'))
+							unbounded = 1;
+					if (*p == '\0')
+						break;
+					if (!neg && cls[-1] == ':' &&
+					    (strncmp(cls, "space:", 6) == 0 ||
+					    strncmp(cls, "cntrl:", 6) == 0))
+						unbounded = 1;
+					p++;
+				} else if (!neg && p[1] == '-' &&
+				    p[2] != '\0' && p[2] != ']' &&
+				    (unsigned char)*p <= CCHR('J') &&
+				    (unsigned char)p[2] >= CCHR('J'))
+					unbounded = 1;
+			}
+			if (*p == '\0')
+				break;
+		} else if (*p == CCHR('J')) {
+			nl++;
+			if (p[1] != '\0' && strchr("*+{", p[1]) != NULL)
+				unbounded = 1;
+		} else if (*p == ')' && p[1] != '\0' &&
+		    strchr("*+{", p[1]) != NULL)
+			rep = 1;
+		else if (*p == '|')
+			alt = 1;
+	}
+	re_nl = (unbounded || (nl && rep)) ? -1 : nl;
+	re_wbuf = NULL;
+
+	re_litlen = 0;
+	if (alt)
+		return;
+	p = re_pat;
+	if (*p == '^')
+		p++;
+	for (; *p != '\0' && *p != CCHR('J'); p++) {
+		if (*p == '\\' && p[1] != '\0' &&
+		    strchr(".[]()|*+?{}^$\\", p[1]) != NULL)
+			p++;
+		else if (strchr(".[]()|*+?{}^$\\", *p) != NULL)
+			break;
+		if (p[1] != '\0' && strchr("*?{", p[1]) != NULL)
+			break;
+		re_lit[re_litlen++] = *p;
+		if (p[1] == '+')
+			break;
+	}
+	re_lit[re_litlen] = '\0';
+}
+
+/*
+ * Could a match start at or after offset "off" of lp?
+ */
+static int
+re_maystart(struct line *lp, int off)
+{
+	const char	*cp, *end;
+	int		 c;
+
+	if (re_litlen == 0)
+		return (TRUE);
+	if (llength(lp) - off < re_litlen)
+		return (FALSE);
+	cp = ltext(lp) + off;
+	end = ltext(lp) + llength(lp) - re_litlen;
+	if (!(re_cflags & REG_ICASE))
+		return (memmem(cp, end - cp + re_litlen, re_lit,
+		    re_litlen) != NULL);
+	c = tolower((unsigned char)re_lit[0]);
+	for (; cp <= end; cp++)
+		if (tolower((unsigned char)*cp) == c &&
+		    strncasecmp(cp, re_lit, re_litlen) == 0)
+			return (TRUE);
+	return (FALSE);
+}
+
+/*
+ * Copy lines into the window, starting with lp, until it holds at least
+ * "want" bytes and more than re_nl lines, or the buffer runs out.
+ */
+static int
+re_wfill(struct line *lp, int lnum, size_t want)
+{
+	struct line	**nlines;
+	size_t		 len = 0, nsize;
+	char		*ntext;
+	int		*noffs, nalloc;
+
+	re_wbuf = NULL;
+	re_wnlines = 0;
+	re_wline = lnum;
+	for (;;) {
+		if (re_wnlines == re_walloc) {
+			nalloc = re_walloc ? re_walloc * 2 : 64;
+			if ((nlines = reallocarray(re_wlines, nalloc,
+			    sizeof(*nlines))) == NULL)
+				return (FALSE);
+			re_wlines = nlines;
+			if ((noffs = reallocarray(re_woffs, nalloc,
+			    sizeof(*noffs))) == NULL)
+				return (FALSE);
+			re_woffs = noffs;
+			re_walloc = nalloc;
+		}
+		if (len + llength(lp) + 1 > re_wsize) {
+			nsize = re_wsize ? re_wsize : RE_WINMIN;
+			while (nsize < len + llength(lp) + 1)
+				nsize *= 2;
+			if (nsize > INT_MAX ||
+			    (ntext = realloc(re_wtext, nsize)) == NULL)
+				return (FALSE);
+			re_wtext = ntext;
+			re_wsize = nsize;
+		}
+		re_wlines[re_wnlines] = lp;
+		re_woffs[re_wnlines++] = len;
+		if (llength(lp) > 0)
+			memcpy(re_wtext + len, ltext(lp), llength(lp));
+		len += llength(lp);
+		if ((lp = lforw(lp)) == curbp->b_headp)
+			break;
+		if (len >= want && re_nl >= 0 && re_wnlines > re_nl)
+			break;
+		re_wtext[len++] = CCHR('J');
+	}
+	re_wtext[len] = '\0';
+	re_wfirst = re_wnext = re_wfrom = 0;
+	re_wbuf = curbp;
+	re_wgen = lgen;
+	return (TRUE);
+}
+
+/*
+ * Return the window line that offset "woff" of the window is in.
+ */
+static int
+re_widx(int woff)
+{
+	int	lo = re_wfirst, hi = re_wnlines - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (re_woffs[mid] <= woff)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (lo);
+}
+
+/*
+ * Turn an offset into the window into a line, offset and line number.
+ */
+static void
+re_wpos(int woff, struct line **lpp, int *offp, int *lnump)
+{
+	int	lo = re_widx(woff);
+
+	*lpp = re_wlines[lo];
+	*offp = woff - re_woffs[lo];
+	if (lnump != NULL)
+		*lnump = re_wline + lo;
+}
+
+/*
+ * If the window is still in step with the buffer and offset "off" of lp
+ * is where the last match ended, or the start of the line after, set
+ * *woffp to where that is in the window.
+ */
+static int
+re_wfind(struct line *lp, int off, int *woffp)
+{
+	int	i;
+
+	if (re_wbuf != curbp || re_wgen != lgen)
+		return (FALSE);
+	for (i = re_wnext; i < re_wnlines && i <= re_wnext + 1; i++)
+		if (re_wlines[i] == lp) {
+			*woffp = re_woffs[i] + off;
+			return (*woffp >= re_wfrom);
+		}
+	return (FALSE);
+}
+
+/*
+ * Dot has just replaced the text of the last match, and is where the
+ * match used to end.  The window still holds the text from there on, so
+ * point it at dot's line and keep it.
+ */
+static void
+re_wreplaced(void)
+{
+	int	eo = regex_match[0].rm_eo, i;
+
+	i = re_widx(eo);
+	re_wlines[i] = curwp->w_dotp;
+	re_woffs[i] = eo - curwp->w_doto;
+	re_wline = curwp->w_dotline - i;
+	re_wfirst = re_wnext = i;
+	re_wfrom = eo;
+	/* what comes before the match decides ^ and word boundaries */
+	if (eo > 0)
+		re_wtext[eo - 1] = curwp->w_doto > 0 ?
+		    lgetc(curwp->w_dotp, curwp->w_doto - 1) : CCHR('J');
+	re_wgen = lgen;
+}
+
+/*
+ * Find the first match starting at or after offset "off" of lp, whose
+ * line number is "lnum".  The match is left in regex_match[].  Returns
+ * ABORT if the window can't be allocated.
+ */
+static int
+re_exec(struct line *lp, int off, int lnum)
+{
+	struct line	*slp;
+	size_t		 want = 0;
+	int		 soff, sline, flags, last, i, woff, reused;
+
+	for (;;) {
+		reused = want == 0 && re_wfind(lp, off, &woff);
+		if (!reused) {
+			while (!re_maystart(lp, off)) {
+				if ((lp = lforw(lp)) == curbp->b_headp)
+					return (FALSE);
+				lnum++;
+				off = 0;
+			}
+			if (re_wfill(lp, lnum, want) == FALSE) {
+				(void)dobeep_msg("Out of memory");
+				return (ABORT);
+			}
+			woff = off;
+		}
+		last = re_wnlines - 1;
+		flags = REG_STARTEND;
+		if (off != 0)
+			flags |= REG_NOTBOL;
+		regex_match[0].rm_so = woff;
+		regex_match[0].rm_eo = re_woffs[last] +
+		    llength(re_wlines[last]);
+		if (regexec(&regex_buff, re_wtext, RE_NMATCH, regex_match,
+		    flags) == 0) {
+			/*
+			 * A match starting in the last re_nl lines might
+			 * have gone on past the end of the window.
+			 */
+			re_wpos(regex_match[0].rm_so, &slp, &soff, &sline);
+			if (lforw(re_wlines[last]) == curbp->b_headp ||
+			    (re_nl >= 0 && sline - re_wline + re_nl <= last)) {
+				re_wnext = re_widx(regex_match[0].rm_eo);
+				return (TRUE);
+			}
+		}
+		if (lforw(re_wlines[last]) == curbp->b_headp)
+			return (FALSE);
+		if (reused) {
+			/* start over with a window of our own */
+			want = RE_WINMIN;
+			continue;
+		}
+		i = last + 1 - re_nl;
+		lp = i > last ? lforw(re_wlines[last]) : re_wlines[i];
+		lnum = re_wline + i;
+		off = 0;
+		if (want == 0)
+			want = RE_WINMIN;
+		else if (want < RE_WINMAX)
+			want *= 2;
+	}
+}
+
 /*
  * Re-Query Replace.
  *	Replace strings selectively.  Does a search and replace operation.
@@ -149,6 +500,7 @@ re_queryrepl(int f, int n)
 	    EFNUL | EFNEW | EFCR, re_pat) == NULL)
 		return (ABORT);
 	ewprintf("Query replacing %s with %s:", re_pat, news);
+	undo_bulk_begin();
 
 	/*
 	 * Search forward repeatedly, checking each time whether to insert
@@ -162,14 +514,14 @@ retry:
 		case ' ':
 			plen = regex_match[0].rm_eo - regex_match[0].rm_so;
 			if (re_doreplace((RSIZE)plen, news) == FALSE)
-				return (FALSE);
+				goto fail;
 			rcnt++;
 			break;
 
 		case '.':
 			plen = regex_match[0].rm_eo - regex_match[0].rm_so;
 			if (re_doreplace((RSIZE)plen, news) == FALSE)
-				return (FALSE);
+				goto fail;
 			rcnt++;
 			goto stopsearch;
 
@@ -183,7 +535,7 @@ retry:
 			do {
 				plen = regex_match[0].rm_eo - regex_match[0].rm_so;
 				if (re_doreplace((RSIZE)plen, news) == FALSE)
-					return (FALSE);
+					goto fail;
 				rcnt++;
 			} while (re_forwsrch() == TRUE);
 			goto stopsearch;
@@ -198,6 +550,7 @@ retry:
 	}
 
 stopsearch:
+	undo_bulk_end();
 	curwp->w_rflag |= WFFULL;
 	update(CMODE);
 	if (!inmacro) {
@@ -209,6 +562,9 @@ stopsearch:
 			ewprintf("(%d replacements done)", rcnt);
 	}
 	return (TRUE);
+fail:
+	undo_bulk_end();
+	return (FALSE);
 }
 
 int
@@ -224,12 +580,16 @@ re_repl(int f, int n)
 	    EFNUL | EFNEW | EFCR, re_pat) == NULL)
                 return (ABORT);
 
+	undo_bulk_begin();
 	while (re_forwsrch() == TRUE) {
 		plen = regex_match[0].rm_eo - regex_match[0].rm_so;
-		if (re_doreplace((RSIZE)plen, news) == FALSE)
+		if (re_doreplace((RSIZE)plen, news) == FALSE) {
+			undo_bulk_end();
 			return (FALSE);
+		}
 		rcnt++;
 	}
+	undo_bulk_end();
 
 	curwp->w_rflag |= WFFULL;
 	update(CMODE);
@@ -248,11 +608,9 @@ re_repl(int f, int n)
 static int
 re_doreplace(RSIZE plen, char *st)
 {
-	int	 j, k, s, more, num, state;
-	struct line	*clp;
+	int	 j, k, s, more, num, state, insync;
 	char	 repstr[REPLEN];
 
-	clp = curwp->w_dotp;
 	more = TRUE;
 	j = 0;
 	state = 0;
@@ -301,7 +659,7 @@ re_doreplace(RSIZE plen, char *st)
 				k = regex_match[num].rm_eo - regex_match[num].rm_so;
 				if (j + k >= REPLEN)
 					return (FALSE);
-				bcopy(&(clp->l_text[regex_match[num].rm_so]),
+				bcopy(&re_wtext[regex_match[num].rm_so],
 				    &repstr[j], k);
 				j += k;
 				if (*st == '\0')
@@ -323,7 +681,10 @@ re_doreplace(RSIZE plen, char *st)
 	}			/* while (more)   */
 
 	repstr[j] = '\0';
+	insync = re_wbuf == curbp && re_wgen == lgen;
 	s = lreplace(plen, repstr);
+	if (s == TRUE && insync)
+		re_wreplaced();
 	return (s);
 }
 
@@ -336,7 +697,7 @@ re_doreplace(RSIZE plen, char *st)
 static int
 re_forwsrch(void)
 {
-	int	 	 re_flags, tbo, tdotline, error;
+	int	 	 tbo, tdotline;
 	struct line	*clp;
 
 	clp = curwp->w_dotp;
@@ -354,31 +715,14 @@ re_forwsrch(void)
 			tdotline++;
 			tbo = 0;
 		}
-	/*
-	 * Note this loop does not process the last line, but this editor
-	 * always makes the last line empty so this is good.
-	 */
-	while (clp != (curbp->b_headp)) {
-		re_flags = REG_STARTEND;
-		if (tbo != 0)
-			re_flags |= REG_NOTBOL;
-		regex_match[0].rm_so = tbo;
-		regex_match[0].rm_eo = llength(clp);
-		error = regexec(&regex_buff, ltext(clp) ? ltext(clp) : "",
-		    RE_NMATCH, regex_match, re_flags);
-		if (error != 0) {
-			clp = lforw(clp);
-			tdotline++;
-			tbo = 0;
-		} else {
-			curwp->w_doto = regex_match[0].rm_eo;
-			curwp->w_dotp = clp;
-			curwp->w_dotline = tdotline;
-			curwp->w_rflag |= WFMOVE;
-			return (TRUE);
-		}
-	}
-	return (FALSE);
+	if (clp == curbp->b_headp)
+		return (FALSE);
+	if (re_exec(clp, tbo, tdotline) != TRUE)
+		return (FALSE);
+	re_wpos(regex_match[0].rm_eo, &curwp->w_dotp, &curwp->w_doto,
+	    &curwp->w_dotline);
+	curwp->w_rflag |= WFMOVE;
+	return (TRUE);
 }
 
 /*
@@ -470,9 +814,9 @@ re_readpattern(char *re_prompt)
 		/* New pattern given */
 		(void)strlcpy(re_pat, tpat, sizeof(re_pat));
 		if (casefoldsearch)
-			flags = REG_EXTENDED | REG_ICASE;
+			flags = REG_EXTENDED | REG_NEWLINE | REG_ICASE;
 		else
-			flags = REG_EXTENDED;
+			flags = REG_EXTENDED | REG_NEWLINE;
 		if (dofree)
 			regfree(&regex_buff);
 		error = regcomp(&regex_buff, re_pat, flags);
@@ -485,6 +829,8 @@ re_readpattern(char *re_prompt)
 			return (FALSE);
 		}
 		dofree = 1;
+		re_cflags = flags;
+		re_setpat();
 		s = TRUE;
 	} else if (rep[0] == '\0' && re_pat[0] != '\0')
 		/* Just using old pattern */
@@ -549,41 +895,220 @@ delnonmatchlines(int f, int n)
 	return (s);
 }
 
+/*
+ * Find the lines the next match from the start of lp lies in, which are
+ * the lines "matching" for flush-lines, keep-lines and friends.  A match
+ * that ends with a newline does not take in the line after it.
+ */
+static int
+re_matchlines(struct line *lp, int lnum, struct line **firstp,
+    struct line **lastp)
+{
+	struct line	*elp;
+	int		 off, eoff, s;
+
+	if ((s = re_exec(lp, 0, lnum)) != TRUE)
+		return (s);
+	re_wpos(regex_match[0].rm_so, firstp, &off, NULL);
+	re_wpos(regex_match[0].rm_eo, &elp, &eoff, NULL);
+	if (eoff == 0 && elp != *firstp)
+		elp = lback(elp);
+	*lastp = elp;
+	return (TRUE);
+}
+
+/*
+ * Lines matching a pattern that cannot span lines are found by several
+ * threads at once.  The lines after dot are split into chunks of RE_CHUNK
+ * lines, which the threads take in turn.  Each thread compiles its own
+ * copy of re_pat, as a regex_t can't be used by two threads at once, and
+ * only ever reads the buffer.  The buffer is changed afterwards, by the
+ * main thread alone.
+ */
+#define RE_CHUNK	4096		/* lines handed out at a time	    */
+#define RE_NTHREADS	16		/* most threads to match with	    */
+
+struct re_pool {
+	pthread_mutex_t	  rp_lock;
+	struct line	**rp_chunks;	/* first line of each chunk	    */
+	int		  rp_nchunks;
+	int		  rp_next;	/* next chunk to hand out	    */
+	int		  rp_nlines;	/* lines in all the chunks	    */
+	char		 *rp_match;	/* TRUE for each matching line	    */
+	int		  rp_error;
+};
+
+/*
+ * Flag those of the n lines from lp that hold a match for re.  Each line
+ * that might is matched on its own, in place.
+ */
+static void
+re_markchunk(regex_t *re, struct line *lp, int n, char *match)
+{
+	regmatch_t	 m;
+	int		 i;
+
+	for (i = 0; i < n; i++, lp = lforw(lp)) {
+		match[i] = FALSE;
+		if (!re_maystart(lp, 0))
+			continue;
+		m.rm_so = 0;
+		m.rm_eo = llength(lp);
+		if (regexec(re, ltext(lp) ? ltext(lp) : "", 1, &m,
+		    REG_STARTEND) == 0)
+			match[i] = TRUE;
+	}
+}
+
+/*
+ * Take chunks from the pool and flag their matching lines until none are
+ * left.
+ */
+static void *
+re_worker(void *arg)
+{
+	struct re_pool	*rp = arg;
+	regex_t		 re;
+	int		 i, n;
+
+	if (regcomp(&re, re_pat, re_cflags) != 0) {
+		pthread_mutex_lock(&rp->rp_lock);
+		rp->rp_error = 1;
+		pthread_mutex_unlock(&rp->rp_lock);
+		return (NULL);
+	}
+	for (;;) {
+		pthread_mutex_lock(&rp->rp_lock);
+		i = rp->rp_error ? rp->rp_nchunks : rp->rp_next++;
+		pthread_mutex_unlock(&rp->rp_lock);
+		if (i >= rp->rp_nchunks)
+			break;
+		n = rp->rp_nlines - i * RE_CHUNK;
+		if (n > RE_CHUNK)
+			n = RE_CHUNK;
+		re_markchunk(&re, rp->rp_chunks[i], n,
+		    rp->rp_match + i * RE_CHUNK);
+	}
+	regfree(&re);
+	return (NULL);
+}
+
+/*
+ * Flag each line from lp, whose line number is lnum, to the end of the
+ * buffer that matches re_pat.  The flags are returned, to be freed by the
+ * caller, and their number left in *nlinesp.  A pattern that can span
+ * lines is matched from one line to the next by re_matchlines(); anything
+ * else goes to the threads.
+ */
+static char *
+re_marklines(struct line *lp, int lnum, int *nlinesp)
+{
+	struct re_pool	 rp;
+	pthread_t	 tids[RE_NTHREADS];
+	sigset_t	 all, old;
+	struct line	**nchunks, *clp, *first = NULL, *last = NULL;
+	long		 ncpu;
+	int		 nalloc = 0, nthreads, i, s;
+
+	memset(&rp, 0, sizeof(rp));
+	for (clp = lp; clp != curbp->b_headp; clp = lforw(clp)) {
+		if (rp.rp_nlines++ % RE_CHUNK != 0)
+			continue;
+		if (rp.rp_nchunks == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : 16;
+			if ((nchunks = reallocarray(rp.rp_chunks, nalloc,
+			    sizeof(*nchunks))) == NULL)
+				goto nomem;
+			rp.rp_chunks = nchunks;
+		}
+		rp.rp_chunks[rp.rp_nchunks++] = clp;
+	}
+	if ((rp.rp_match = calloc(rp.rp_nlines + 1, 1)) == NULL)
+		goto nomem;
+
+	if (re_nl != 0) {
+		for (clp = lp, i = 0; clp != curbp->b_headp; i++) {
+			if ((s = re_matchlines(clp, lnum + i, &first, &last)) ==
+			    ABORT)
+				goto fail;
+			if (s == FALSE)
+				break;
+			for (; clp != first; clp = lforw(clp))
+				i++;
+			for (;; clp = lforw(clp), i++) {
+				rp.rp_match[i] = TRUE;
+				if (clp == last)
+					break;
+			}
+			clp = lforw(clp);
+		}
+	} else {
+		if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			ncpu = 1;
+		nthreads = rp.rp_nchunks;
+		if (nthreads > ncpu)
+			nthreads = ncpu;
+		if (nthreads > RE_NTHREADS)
+			nthreads = RE_NTHREADS;
+		pthread_mutex_init(&rp.rp_lock, NULL);
+
+		/* Leave signals to the main thread. */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		for (i = 0; i < nthreads - 1; i++)
+			if (pthread_create(&tids[i], NULL, re_worker, &rp) != 0)
+				break;
+		nthreads = i;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		(void)re_worker(&rp);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(tids[i], NULL);
+		pthread_mutex_destroy(&rp.rp_lock);
+		if (rp.rp_error)
+			goto nomem;
+	}
+	free(rp.rp_chunks);
+	*nlinesp = rp.rp_nlines;
+	return (rp.rp_match);
+nomem:
+	(void)dobeep_msg("Out of memory");
+fail:
+	free(rp.rp_chunks);
+	free(rp.rp_match);
+	return (NULL);
+}
+
 /*
  * This function does the work of deleting matching lines.
  */
 static int
 killmatches(int cond)
 {
-	int	 s, error;
-	int	 count = 0;
 	struct line	*clp;
+	char		*match;
+	int		 lnum, nlines, i, s;
+	int		 count = 0;
 
 	clp = curwp->w_dotp;
-	if (curwp->w_doto == llength(clp))
+	lnum = curwp->w_dotline;
+	if (curwp->w_doto == llength(clp)) {
 		/* Consider dot on next line */
 		clp = lforw(clp);
+		lnum++;
+	}
 
-	while (clp != (curbp->b_headp)) {
-		/* see if line matches */
-		regex_match[0].rm_so = 0;
-		regex_match[0].rm_eo = llength(clp);
-		error = regexec(&regex_buff, ltext(clp) ? ltext(clp) : "",
-		    RE_NMATCH, regex_match, REG_STARTEND);
-
-		/* Delete line when appropriate */
-		if ((cond == FALSE && error) || (cond == TRUE && !error)) {
-			curwp->w_doto = 0;
-			curwp->w_dotp = clp;
+	if ((match = re_marklines(clp, lnum, &nlines)) == NULL)
+		return (FALSE);
+	for (i = 0; i < nlines; i++)
+		if ((match[i] = (match[i] == cond)))
 			count++;
-			s = ldelete(llength(clp) + 1, KNONE);
-			clp = curwp->w_dotp;
-			curwp->w_rflag |= WFMOVE;
-			if (s == FALSE)
-				return (FALSE);
-		} else
-			clp = lforw(clp);
-	}
+	s = TRUE;
+	if (count > 0)
+		s = ldellines(clp, lnum, match, nlines);
+	free(match);
+	if (s != TRUE)
+		return (s);
 
 	ewprintf("%d line(s) deleted", count);
 	if (count > 0)
@@ -628,27 +1153,25 @@ cntnonmatchlines(int f, int n)
 int
 countmatches(int cond)
 {
-	int	 error;
-	int	 count = 0;
 	struct line	*clp;
+	char		*match;
+	int		 lnum, nlines, i;
+	int		 count = 0;
 
 	clp = curwp->w_dotp;
-	if (curwp->w_doto == llength(clp))
+	lnum = curwp->w_dotline;
+	if (curwp->w_doto == llength(clp)) {
 		/* Consider dot on next line */
 		clp = lforw(clp);
+		lnum++;
+	}
 
-	while (clp != (curbp->b_headp)) {
-		/* see if line matches */
-		regex_match[0].rm_so = 0;
-		regex_match[0].rm_eo = llength(clp);
-		error = regexec(&regex_buff, ltext(clp) ? ltext(clp) : "",
-		    RE_NMATCH, regex_match, REG_STARTEND);
-
-		/* Count line when appropriate */
-		if ((cond == FALSE && error) || (cond == TRUE && !error))
+	if ((match = re_marklines(clp, lnum, &nlines)) == NULL)
+		return (FALSE);
+	for (i = 0; i < nlines; i++)
+		if (match[i] == cond)
 			count++;
-		clp = lforw(clp);
-	}
+	free(match);
 
 	if (cond)
 		ewprintf("Number of lines matching: %d", count);
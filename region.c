@@ -70,6 +70,8 @@ copyregion(int f, int n)
 {
 	struct line	*linep;
 	struct region	 region;
+	RSIZE	 chunk;
+	char	*cp = NULL;
 	int	 loffs;
 	int	 s;
 
@@ -87,16 +89,23 @@ copyregion(int f, int n)
 	/* current offset */
 	loffs = region.r_offset;
 
-	while (region.r_size--) {
+	if (region.r_size > 0 &&
+	    (cp = kreserve(region.r_size, KFORW)) == NULL)
+		return (FALSE);
+	while (region.r_size > 0) {
 		if (loffs == llength(linep)) {	/* End of line.		 */
-			if ((s = kinsert(*curbp->b_nlchr, KFORW)) != TRUE)
-				return (s);
+			*cp++ = *curbp->b_nlchr;
+			region.r_size--;
 			linep = lforw(linep);
 			loffs = 0;
 		} else {			/* Middle of line.	 */
-			if ((s = kinsert(lgetc(linep, loffs), KFORW)) != TRUE)
-				return (s);
-			++loffs;
+			chunk = llength(linep) - loffs;
+			if (chunk > region.r_size)
+				chunk = region.r_size;
+			memcpy(cp, &ltext(linep)[loffs], chunk);
+			cp += chunk;
+			region.r_size -= chunk;
+			loffs += chunk;
 		}
 	}
 	clearmark(FFARG, 0);
@@ -379,14 +388,7 @@ region_get_data(struct region *reg, char *buf, int len)
 void
 region_put_data(const char *buf, int len)
 {
-	int i;
-
-	for (i = 0; buf[i] != '\0' && i < len; i++) {
-		if (buf[i] == *curbp->b_nlchr)
-			lnewline();
-		else
-			linsert(1, buf[i]);
-	}
+	(void)linsert_str(buf, strnlen(buf, len));
 }
 
 /*
@@ -32,6 +32,10 @@ struct srchcom {
 	struct line	*s_dotp;
 	int		 s_doto;
 	int		 s_dotline;
+	struct line	*s_matchp;
+	int		 s_matcho;
+	int		 s_matchline;
+	int		 s_matchdir;
 };
 
 static int	isearch(int);
@@ -41,13 +45,30 @@ static void	is_pop(void);
 static int	is_peek(void);
 static void	is_undo(int *, int *);
 static int	is_find(int);
+static int	is_grow(int);
+static int	is_search(int);
 static void	is_prompt(int, int, int);
 static void	is_dspl(char *, int);
-static int	eq(int, int, int);
 
 static struct srchcom	cmds[NSRCH];
 static int	cip;
 
+/*
+ * The end of the current isearch match that dot is not at: its start
+ * when searching forward, its end when searching backward.  It is kept
+ * on the cmds stack with dot, so a character added to the pattern is
+ * looked for from the match it extends.
+ */
+static struct line	*is_matchp;
+static int		 is_matcho;
+static int		 is_matchline;
+static int		 is_matchdir = SRCH_NOPR;
+
+/* The same for the last match forwsrch() or backsrch() found. */
+static struct line	*srchmatchp;
+static int		 srchmatcho;
+static int		 srchmatchline;
+
 int		srch_lastdir = SRCH_NOPR;	/* Last search flags.	 */
 
 /*
@@ -188,6 +209,7 @@ isearch(int dir)
 	(void)strlcpy(opat, pat, sizeof(opat));
 	cip = 0;
 	pptr = -1;
+	is_matchdir = SRCH_NOPR;
 	clp = curwp->w_dotp;
 	cbo = curwp->w_doto;
 	cdotline = curwp->w_dotline;
@@ -307,6 +329,7 @@ isearch(int dir)
 			break;
 		case CCHR('W'):
 			/* add the rest of the current word to the pattern */
+			is_matchdir = SRCH_NOPR;
 			clp = curwp->w_dotp;
 			cbo = curwp->w_doto;
 			firstc = 1;
@@ -384,7 +407,7 @@ isearch(int dir)
 			}
 			is_lpush();
 			if (success != FALSE) {
-				if (is_find(dir) != FALSE)
+				if (is_grow(dir) != FALSE)
 					is_cpush(c);
 				else {
 					success = FALSE;
@@ -419,6 +442,10 @@ is_lpush(void)
 	cmds[ctp].s_doto = curwp->w_doto;
 	cmds[ctp].s_dotp = curwp->w_dotp;
 	cmds[ctp].s_dotline = curwp->w_dotline;
+	cmds[ctp].s_matchp = is_matchp;
+	cmds[ctp].s_matcho = is_matcho;
+	cmds[ctp].s_matchline = is_matchline;
+	cmds[ctp].s_matchdir = is_matchdir;
 }
 
 static void
@@ -429,6 +456,10 @@ is_pop(void)
 		curwp->w_dotp = cmds[cip].s_dotp;
 		curwp->w_dotline = cmds[cip].s_dotline;
 		curwp->w_rflag |= WFMOVE;
+		is_matchp = cmds[cip].s_matchp;
+		is_matcho = cmds[cip].s_matcho;
+		is_matchline = cmds[cip].s_matchline;
+		is_matchdir = cmds[cip].s_matchdir;
 		cmds[cip].s_code = SRCH_NOPR;
 	}
 	if (--cip <= 0)
@@ -475,42 +506,96 @@ is_undo(int *pptr, int *dir)
 		is_undo(pptr, dir);
 }
 
+/*
+ * Look for the pattern again from around dot: forward from "pat"'s
+ * length before dot, backward from that far after it.
+ */
 static int
 is_find(int dir)
 {
-	int	 plen, odoto, odotline;
 	struct line	*odotp;
+	int		 plen, odoto, odotline;
 
 	odoto = curwp->w_doto;
 	odotp = curwp->w_dotp;
 	odotline = curwp->w_dotline;
 	plen = strlen(pat);
-	if (plen != 0) {
-		if (dir == SRCH_FORW) {
-			(void)backchar(FFARG | FFRAND, plen);
-			if (forwsrch() == FALSE) {
-				curwp->w_doto = odoto;
-				curwp->w_dotp = odotp;
-				curwp->w_dotline = odotline;
-				return (FALSE);
-			}
-			return (TRUE);
-		}
-		if (dir == SRCH_BACK) {
-			(void)forwchar(FFARG | FFRAND, plen);
-			if (backsrch() == FALSE) {
-				curwp->w_doto = odoto;
-				curwp->w_dotp = odotp;
-				curwp->w_dotline = odotline;
-				return (FALSE);
-			}
-			return (TRUE);
-		}
+	if (plen == 0)
+		return (FALSE);
+	if (dir == SRCH_FORW)
+		(void)backchar(FFARG | FFRAND, plen);
+	else if (dir == SRCH_BACK)
+		(void)forwchar(FFARG | FFRAND, plen);
+	if (is_search(dir) == FALSE) {
+		curwp->w_doto = odoto;
+		curwp->w_dotp = odotp;
+		curwp->w_dotline = odotline;
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+/*
+ * A character has just been added to the pattern.  Look for it from
+ * the match the shorter pattern found, so that match is tried first
+ * and nothing before it is scanned again: forward from its start,
+ * backward from one past its end.
+ */
+static int
+is_grow(int dir)
+{
+	struct line	*odotp;
+	int		 plen, odoto, odotline;
+
+	odoto = curwp->w_doto;
+	odotp = curwp->w_dotp;
+	odotline = curwp->w_dotline;
+	plen = strlen(pat);
+	if (plen == 0)
+		return (FALSE);
+	if (is_matchdir == dir) {
+		curwp->w_dotp = is_matchp;
+		curwp->w_doto = is_matcho;
+		curwp->w_dotline = is_matchline;
+	} else if (dir == SRCH_FORW)
+		(void)backchar(FFARG | FFRAND, plen - 1);
+	else if (dir == SRCH_BACK)
+		(void)forwchar(FFARG | FFRAND, plen - 1);
+	if (dir == SRCH_BACK)
+		(void)forwchar(FFARG | FFRAND, 1);
+	if (is_search(dir) == FALSE) {
+		curwp->w_doto = odoto;
+		curwp->w_dotp = odotp;
+		curwp->w_dotline = odotline;
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+/*
+ * Search from dot, and remember where the match found starts or ends.
+ */
+static int
+is_search(int dir)
+{
+	int	 s;
+
+	if (dir == SRCH_FORW)
+		s = forwsrch();
+	else if (dir == SRCH_BACK)
+		s = backsrch();
+	else {
 		dobeep();
 		ewprintf("bad call to is_find");
 		return (FALSE);
 	}
-	return (FALSE);
+	if (s == FALSE)
+		return (FALSE);
+	is_matchp = srchmatchp;
+	is_matcho = srchmatcho;
+	is_matchline = srchmatchline;
+	is_matchdir = dir;
+	return (TRUE);
 }
 
 /*
@@ -576,6 +661,7 @@ queryrepl(int f, int n)
 		news[0] = '\0';
 	ewprintf("Query replacing %s with %s:", pat, news);
 	plen = strlen(pat);
+	undo_bulk_begin();
 
 	/*
 	 * Search forward repeatedly, checking each time whether to insert
@@ -589,12 +675,12 @@ retry:
 		case 'y':
 		case ' ':
 			if (lreplace((RSIZE)plen, news) == FALSE)
-				return (FALSE);
+				goto fail;
 			rcnt++;
 			break;
 		case '.':
 			if (lreplace((RSIZE)plen, news) == FALSE)
-				return (FALSE);
+				goto fail;
 			rcnt++;
 			goto stopsearch;
 		/* ^G, CR or ESC */
@@ -607,7 +693,7 @@ retry:
 		case '!':
 			do {
 				if (lreplace((RSIZE)plen, news) == FALSE)
-					return (FALSE);
+					goto fail;
 				rcnt++;
 			} while (forwsrch() == TRUE);
 			goto stopsearch;
@@ -622,6 +708,7 @@ retry:
 		}
 	}
 stopsearch:
+	undo_bulk_end();
 	curwp->w_rflag |= WFFULL;
 	update(CMODE);
 	if (rcnt == 1)
@@ -629,6 +716,9 @@ stopsearch:
 	else
 		ewprintf("Replaced %d occurrences", rcnt);
 	return (TRUE);
+fail:
+	undo_bulk_end();
+	return (FALSE);
 }
 
 /*
@@ -650,13 +740,17 @@ replstr(int f, int n)
 		 return (ABORT);
 
 	plen = strlen(pat);
+	undo_bulk_begin();
 	while (forwsrch() == TRUE) {
 		update(CMODE);
-		if (lreplace((RSIZE)plen, news) == FALSE)
+		if (lreplace((RSIZE)plen, news) == FALSE) {
+			undo_bulk_end();
 			return (FALSE);
+		}
 
 		rcnt++;
 	}
+	undo_bulk_end();
 
 	curwp->w_rflag |= WFFULL;
 	update(CMODE);
@@ -669,6 +763,179 @@ replstr(int f, int n)
 	return (TRUE);
 }
 
+/*
+ * The literal search engine.  "pat" is compiled into a case folding map
+ * and a pair of Horspool shift tables, and is rebuilt only when "pat"
+ * changes.  Buffer text is never copied: a pattern without a newline is
+ * looked for inside each line's text, and a pattern with newlines can
+ * only match the tail of one line, whole lines, and the head of another,
+ * so those are compared directly.  As in the old character at a time
+ * search, a pattern with no upper case letters matches either case.
+ */
+static char		srchpat[NPAT];	/* "pat" the tables were built for */
+static char		srchfold[NPAT];	/* "pat" with case folded out	   */
+static unsigned char	srchmap[256];	/* buffer character to pattern	   */
+static int		srchfshift[256];	/* forward shift table	   */
+static int		srchbshift[256];	/* backward shift table	   */
+static int		srchlen;	/* length of the pattern	   */
+static int		srchnl;		/* newlines in the pattern	   */
+static int		srchhead;	/* length before the first newline */
+static int		srchtail;	/* length after the last newline   */
+static int		srchxcase;	/* pattern is case sensitive	   */
+static int		srchfprobe;	/* first character memchr()'able   */
+static int		srchbprobe;	/* last character memrchr()'able   */
+
+static void
+srchcomp(void)
+{
+	unsigned char	*fp;
+	int		 c, i;
+
+	if (srchlen != 0 && strcmp(srchpat, pat) == 0)
+		return;
+	(void)strlcpy(srchpat, pat, sizeof(srchpat));
+	srchlen = strlen(srchpat);
+	srchxcase = 0;
+	for (i = 0; i < srchlen; i++)
+		if (ISUPPER(CHARMASK(srchpat[i])))
+			srchxcase = 1;
+	for (c = 0; c < 256; c++)
+		srchmap[c] = (!srchxcase && ISUPPER(c)) ? TOLOWER(c) : c;
+
+	fp = (unsigned char *)srchfold;
+	srchnl = srchhead = srchtail = 0;
+	for (i = 0; i < srchlen; i++) {
+		fp[i] = srchmap[CHARMASK(srchpat[i])];
+		if (fp[i] == CCHR('J')) {
+			if (srchnl++ == 0)
+				srchhead = i;
+			srchtail = srchlen - i - 1;
+		}
+	}
+	fp[srchlen] = '\0';
+	if (srchlen == 0)
+		return;
+
+	/* A byte can be probed for only if nothing else folds into it. */
+	srchfprobe = srchbprobe = 1;
+	for (c = 0; c < 256; c++) {
+		if (srchmap[c] == c)
+			continue;
+		if (srchmap[c] == fp[0])
+			srchfprobe = 0;
+		if (srchmap[c] == fp[srchlen - 1])
+			srchbprobe = 0;
+	}
+	for (c = 0; c < 256; c++)
+		srchfshift[c] = srchbshift[c] = srchlen;
+	for (i = 0; i < srchlen - 1; i++)
+		srchfshift[fp[i]] = srchlen - 1 - i;
+	for (i = srchlen - 1; i > 0; i--)
+		srchbshift[fp[i]] = i;
+}
+
+/*
+ * Compare "len" bytes of buffer text with folded pattern text.
+ */
+static int
+srchcmp(const char *text, const char *pp, int len)
+{
+	const unsigned char	*tp = (const unsigned char *)text;
+	const unsigned char	*up = (const unsigned char *)pp;
+	int			 i;
+
+	if (srchxcase)
+		return (len == 0 || memcmp(tp, up, len) == 0);
+	for (i = 0; i < len; i++)
+		if (srchmap[tp[i]] != up[i])
+			return (FALSE);
+	return (TRUE);
+}
+
+/*
+ * Find the first match of a single line pattern in text[s..n).  Where
+ * the first character of the pattern cannot be folded into, memchr()
+ * skips to the next place the match could start before each compare.
+ */
+static int
+srchfline(const char *text, int s, int n)
+{
+	const unsigned char	*tp = (const unsigned char *)text;
+	const unsigned char	*fp = (const unsigned char *)srchfold;
+	const unsigned char	*q;
+	int			 m = srchlen, c;
+
+	while (n - s >= m) {
+		if (srchfprobe) {
+			q = memchr(tp + s, fp[0], n - s - m + 1);
+			if (q == NULL)
+				break;
+			s = q - tp;
+		}
+		c = srchmap[tp[s + m - 1]];
+		if (c == fp[m - 1] && srchcmp(text + s, srchfold, m - 1))
+			return (s);
+		s += srchfshift[c];
+	}
+	return (-1);
+}
+
+/*
+ * Find the last match of a single line pattern that ends by text[e].
+ */
+static int
+srchbline(const char *text, int e)
+{
+	const unsigned char	*tp = (const unsigned char *)text;
+	const unsigned char	*fp = (const unsigned char *)srchfold;
+	const unsigned char	*q;
+	int			 m = srchlen, s, c;
+
+	for (s = e - m; s >= 0; s -= srchbshift[c]) {
+		if (srchbprobe) {
+			q = memrchr(tp + m - 1, fp[m - 1], s + 1);
+			if (q == NULL)
+				break;
+			s = q - tp - (m - 1);
+		}
+		c = srchmap[tp[s]];
+		if (c == fp[0] && srchcmp(text + s + 1, srchfold + 1, m - 1))
+			return (s);
+	}
+	return (-1);
+}
+
+/*
+ * See whether a pattern with newlines matches starting in the last
+ * "srchhead" characters of lp.  If so, return the line the match ends
+ * in; it ends "srchtail" characters into that line.
+ */
+static struct line *
+srchlines(struct line *lp)
+{
+	const char	*pp;
+	int		 i, len;
+
+	len = llength(lp);
+	if (len < srchhead ||
+	    !srchcmp(ltext(lp) + len - srchhead, srchfold, srchhead))
+		return (NULL);
+	pp = srchfold + srchhead + 1;
+	for (i = 1; i < srchnl; i++) {
+		if ((lp = lforw(lp)) == curbp->b_headp)
+			return (NULL);
+		len = strchr(pp, CCHR('J')) - pp;
+		if (llength(lp) != len || !srchcmp(ltext(lp), pp, len))
+			return (NULL);
+		pp += len + 1;
+	}
+	if ((lp = lforw(lp)) == curbp->b_headp)
+		return (NULL);
+	if (llength(lp) < srchtail || !srchcmp(ltext(lp), pp, srchtail))
+		return (NULL);
+	return (lp);
+}
+
 /*
  * This routine does the real work of a forward search.  The pattern is sitting
  * in the external variable "pat".  If found, dot is updated, the window system
@@ -679,54 +946,40 @@ int
 forwsrch(void)
 {
 	struct line	*clp, *tlp;
-	int	 cbo, tbo, c, i, xcase = 0;
-	char	*pp;
-	int	 nline;
+	int		 cbo, tbo, nline;
 
+	srchcomp();
+	if (srchlen == 0)
+		return (FALSE);
 	clp = curwp->w_dotp;
 	cbo = curwp->w_doto;
 	nline = curwp->w_dotline;
-	for (i = 0; pat[i]; i++)
-		if (ISUPPER(CHARMASK(pat[i])))
-			xcase = 1;
 	for (;;) {
-		if (cbo == llength(clp)) {
-			if ((clp = lforw(clp)) == curbp->b_headp)
+		if (srchnl == 0) {
+			if ((tbo = srchfline(ltext(clp), cbo, llength(clp))) >= 0) {
+				srchmatcho = tbo;
+				tlp = clp;
+				tbo += srchlen;
 				break;
-			nline++;
-			cbo = 0;
-			c = CCHR('J');
-		} else
-			c = lgetc(clp, cbo++);
-		if (eq(c, pat[0], xcase) != FALSE) {
-			tlp = clp;
-			tbo = cbo;
-			pp = &pat[1];
-			while (*pp != 0) {
-				if (tbo == llength(tlp)) {
-					tlp = lforw(tlp);
-					if (tlp == curbp->b_headp)
-						goto fail;
-					tbo = 0;
-					c = CCHR('J');
-					if (eq(c, *pp++, xcase) == FALSE)
-						goto fail;
-					nline++;
-				} else {
-					c = lgetc(tlp, tbo++);
-					if (eq(c, *pp++, xcase) == FALSE)
-						goto fail;
-				}
 			}
-			curwp->w_dotp = tlp;
-			curwp->w_doto = tbo;
-			curwp->w_dotline = nline;
-			curwp->w_rflag |= WFMOVE;
-			return (TRUE);
+		} else if (llength(clp) - srchhead >= cbo &&
+		    (tlp = srchlines(clp)) != NULL) {
+			srchmatcho = llength(clp) - srchhead;
+			tbo = srchtail;
+			break;
 		}
-fail:		;
+		if ((clp = lforw(clp)) == curbp->b_headp)
+			return (FALSE);
+		nline++;
+		cbo = 0;
 	}
-	return (FALSE);
+	srchmatchp = clp;
+	srchmatchline = nline;
+	curwp->w_dotp = tlp;
+	curwp->w_doto = tbo;
+	curwp->w_dotline = nline + srchnl;
+	curwp->w_rflag |= WFMOVE;
+	return (TRUE);
 }
 
 /*
@@ -738,81 +991,40 @@ fail:		;
 int
 backsrch(void)
 {
-	struct line	*clp, *tlp;
-	int	 cbo, tbo, c, i, xcase = 0;
-	char	*epp, *pp;
-	int	 nline, pline;
+	struct line	*clp;
+	int		 cbo, nline, back;
 
-	for (epp = &pat[0]; epp[1] != 0; ++epp);
+	srchcomp();
+	if (srchlen == 0)
+		return (FALSE);
 	clp = curwp->w_dotp;
 	cbo = curwp->w_doto;
 	nline = curwp->w_dotline;
-	for (i = 0; pat[i]; i++)
-		if (ISUPPER(CHARMASK(pat[i])))
-			xcase = 1;
-	for (;;) {
-		if (cbo == 0) {
-			clp = lback(clp);
-			if (clp == curbp->b_headp)
-				return (FALSE);
-			nline--;
-			cbo = llength(clp) + 1;
-		}
-		if (--cbo == llength(clp))
-			c = CCHR('J');
-		else
-			c = lgetc(clp, cbo);
-		if (eq(c, *epp, xcase) != FALSE) {
-			tlp = clp;
-			tbo = cbo;
-			pp = epp;
-			pline = nline;
-			while (pp != &pat[0]) {
-				if (tbo == 0) {
-					tlp = lback(tlp);
-					if (tlp == curbp->b_headp)
-						goto fail;
-					nline--;
-					tbo = llength(tlp) + 1;
-				}
-				if (--tbo == llength(tlp))
-					c = CCHR('J');
-				else
-					c = lgetc(tlp, tbo);
-				if (eq(c, *--pp, xcase) == FALSE) {
-					nline = pline;
-					goto fail;
-				}
+	for (back = 0;; back++) {
+		if (srchnl == 0) {
+			if ((cbo = srchbline(ltext(clp), cbo)) >= 0) {
+				srchmatchp = clp;
+				srchmatcho = cbo + srchlen;
+				break;
 			}
-			curwp->w_dotp = tlp;
-			curwp->w_doto = tbo;
-			curwp->w_dotline = nline;
-			curwp->w_rflag |= WFMOVE;
-			return (TRUE);
+		} else if ((back > srchnl ||
+		    (back == srchnl && srchtail <= curwp->w_doto)) &&
+		    (srchmatchp = srchlines(clp)) != NULL) {
+			srchmatcho = srchtail;
+			cbo = llength(clp) - srchhead;
+			break;
 		}
-fail:		;
+		if ((clp = lback(clp)) == curbp->b_headp)
+			return (FALSE);
+		nline--;
+		cbo = llength(clp);
 	}
-	/* NOTREACHED */
-}
-
-/*
- * Compare two characters.  The "bc" comes from the buffer.  It has its case
- * folded out. The "pc" is from the pattern.
- */
-static int
-eq(int bc, int pc, int xcase)
-{
-	bc = CHARMASK(bc);
-	pc = CHARMASK(pc);
-	if (bc == pc)
-		return (TRUE);
-	if (xcase)
-		return (FALSE);
-	if (ISUPPER(bc))
-		return (TOLOWER(bc) == pc);
-	if (ISUPPER(pc))
-		return (bc == TOLOWER(pc));
-	return (FALSE);
+	srchmatchline = nline + srchnl;
+	curwp->w_dotp = clp;
+	curwp->w_doto = cbo;
+	curwp->w_dotline = nline;
+	curwp->w_rflag |= WFMOVE;
+	return (TRUE);
 }
 
 /*
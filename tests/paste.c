@@ -0,0 +1,117 @@
+/* This file is in the public domain. */
+
+/*
+ * Paste text into mg through a pseudo terminal, save it and check that
+ * the file holds the text as it was pasted.  A C-g inside pasted text
+ * is text like any other character, not keyboard-quit.
+ *
+ *	paste-test /path/to/mg
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#if HAVE_PTY_H
+#include <pty.h>
+#elif HAVE_UTIL_H
+#include <util.h>
+#endif
+
+static const char	paste[] = "\033[200~one\007two\rthree\r\033[201~";
+static const char	want[] = "one\007two\nthree\n";
+
+static void	drain(int, int);
+static void	sendkeys(int, const char *, size_t);
+
+/*
+ * Read what mg writes to the terminal until it has been quiet for msec
+ * milliseconds, so it never blocks on a full pty.
+ */
+static void
+drain(int fd, int msec)
+{
+	struct pollfd	pfd;
+	char		buf[4096];
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, msec) > 0)
+		if (read(fd, buf, sizeof(buf)) <= 0)
+			return;
+}
+
+static void
+sendkeys(int fd, const char *s, size_t len)
+{
+	if (write(fd, s, len) != (ssize_t)len)
+		err(1, "write");
+	drain(fd, 300);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct winsize	 ws;
+	char		 file[] = "/tmp/mgpaste.XXXXXX", got[64];
+	ssize_t		 n;
+	pid_t		 pid;
+	int		 fd, i, status;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: paste-test mg\n");
+		return (2);
+	}
+	if ((fd = mkstemp(file)) == -1)
+		err(1, "mkstemp");
+	close(fd);
+
+	memset(&ws, 0, sizeof(ws));
+	ws.ws_row = 24;
+	ws.ws_col = 80;
+	if ((pid = forkpty(&fd, NULL, NULL, &ws)) == -1)
+		err(1, "forkpty");
+	if (pid == 0) {
+		setenv("TERM", "xterm", 1);
+		execl(argv[1], argv[1], "-n", "-u", "/dev/null", file,
+		    (char *)NULL);
+		err(1, "%s", argv[1]);
+	}
+
+	drain(fd, 500);
+	sendkeys(fd, paste, sizeof(paste) - 1);
+	/* save-buffer, save-buffers-kill-emacs */
+	sendkeys(fd, "\030\023\030\003", 4);
+	for (i = 0; waitpid(pid, &status, WNOHANG) == 0; i++) {
+		if (i == 50) {
+			kill(pid, SIGKILL);
+			unlink(file);
+			errx(1, "mg did not exit");
+		}
+		drain(fd, 0);
+		usleep(100000);
+	}
+	close(fd);
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(1, "%s", file);
+	n = read(fd, got, sizeof(got));
+	close(fd);
+	unlink(file);
+	if (n != sizeof(want) - 1 || memcmp(got, want, n) != 0) {
+		fprintf(stderr, "paste-test: file has %zd bytes \"%.*s\"\n",
+		    n, n > 0 ? (int)n : 0, got);
+		return (1);
+	}
+	return (0);
+}
@@ -33,6 +33,8 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <term.h>
 #include <unistd.h>
 
@@ -40,6 +42,33 @@
 
 static int	 charcost(const char *);
 
+/*
+ * Escape sequences used on the hot paths of redisplay, checked once so
+ * they can be sent without going through tputs().  A sequence that
+ * needs padding, or that the terminal lacks, has a NULL e_str and a
+ * HUGE e_len.
+ */
+struct ttesc {
+	const char	*e_str;		/* The sequence.		*/
+	int		 e_len;		/* Its length.			*/
+};
+
+static struct ttesc	 esc_cr, esc_down, esc_up, esc_left, esc_right;
+static struct ttesc	 esc_home, esc_eol, esc_so, esc_se;
+
+/*
+ * Cursor addressing strings, formatted by tgoto() the first time each
+ * position is used.  An entry starting with a NUL is not filled in yet,
+ * or could not be cached if its second byte is set too.
+ */
+#define TTCUPLEN	16
+static char		(*cupcache)[TTCUPLEN];
+static int		 cuprows, cupcols;
+
+static void	 ttescset(struct ttesc *, const char *);
+static void	 ttescput(const struct ttesc *, const char *);
+static const char *ttcup(int, int);
+
 static int	 cci;
 static int	 insdel;	/* Do we have both insert & delete line? */
 static char	*scroll_fwd;	/* How to scroll forward. */
@@ -126,6 +155,17 @@ ttinit(void)
 	insdel = (insert_line || parm_insert_line) &&
 	    (delete_line || parm_delete_line);
 
+	/* Sequences for cheap cursor motion and the like */
+	ttescset(&esc_cr, carriage_return);
+	ttescset(&esc_down, cursor_down);
+	ttescset(&esc_up, cursor_up);
+	ttescset(&esc_left, cursor_left);
+	ttescset(&esc_right, cursor_right);
+	ttescset(&esc_home, cursor_home);
+	ttescset(&esc_eol, clr_eol);
+	ttescset(&esc_so, enter_standout_mode);
+	ttescset(&esc_se, exit_standout_mode);
+
 	if (enter_ca_mode)
 		/* enter application mode */
 		putpad(enter_ca_mode, 1);
@@ -135,7 +175,6 @@ ttinit(void)
 
 /*
  * Re-initialize the terminal when the editor is resumed.
- * The keypad_xmit doesn't really belong here but...
  */
 void
 ttreinit(void)
@@ -149,9 +188,7 @@ ttreinit(void)
 		/* enter application mode */
 		putpad(enter_ca_mode, 1);
 
-	if (keypad_xmit)
-		/* turn on keypad */
-		putpad(keypad_xmit, 1);
+	ttykeymapreinit();
 
 	ttresize();
 }
@@ -173,18 +210,133 @@ tttidy(void)
 }
 
 /*
- * Move the cursor to the specified origin 0 row and column position. Try to
- * optimize out extra moves; redisplay may have left the cursor in the right
- * location last time!
+ * Remember sequence str in e if it can be sent as it is.
+ */
+static void
+ttescset(struct ttesc *e, const char *str)
+{
+	if (str == NULL || *str == '\0' || strstr(str, "$<") != NULL) {
+		e->e_str = NULL;
+		e->e_len = HUGE;
+	} else {
+		e->e_str = str;
+		e->e_len = strlen(str);
+	}
+}
+
+/*
+ * Send the sequence in e, or str through tputs() if e could not be
+ * cached.
+ */
+static void
+ttescput(const struct ttesc *e, const char *str)
+{
+	const char	*cp;
+
+	if (e->e_str == NULL) {
+		putpad(str, 1);
+		return;
+	}
+	for (cp = e->e_str; *cp != '\0'; ++cp)
+		ttputc(*cp);
+}
+
+/*
+ * Return the cursor addressing string for row and col, or NULL if
+ * it has to go through tputs().  The cache is rebuilt when the screen
+ * size changes.
+ */
+static const char *
+ttcup(int row, int col)
+{
+	const char	*str;
+	char		*cp;
+
+	if (cuprows != nrow || cupcols != ncol) {
+		free(cupcache);
+		cupcache = calloc((size_t)nrow * ncol, TTCUPLEN);
+		cuprows = cupcache != NULL ? nrow : 0;
+		cupcols = cupcache != NULL ? ncol : 0;
+	}
+	if (row < 0 || row >= cuprows || col < 0 || col >= cupcols)
+		return (NULL);
+	cp = cupcache[row * cupcols + col];
+	if (cp[0] == '\0') {
+		if (cp[1] != '\0')
+			return (NULL);
+		str = tgoto(cursor_address, col, row);
+		if (strlen(str) >= TTCUPLEN || strstr(str, "$<") != NULL) {
+			cp[1] = 1;
+			return (NULL);
+		}
+		(void)strlcpy(cp, str, TTCUPLEN);
+	}
+	return (cp);
+}
+
+/*
+ * Move the cursor to the specified origin 0 row and column position.
+ * Use the cheapest of cursor addressing, home, and relative motions
+ * from where the cursor is, if that is known.  Relative motions are
+ * not used from past the last column, where terminals differ, nor
+ * with line feeds that could scroll the scrolling region.
  */
 void
 ttmove(int row, int col)
 {
-	if (ttrow != row || ttcol != col) {
-		putpad(tgoto(cursor_address, col, row), 1);
+	const char	*cup, *cp;
+	int		 vcost, hcost, crcost, best, i;
+
+	if (ttrow == row && ttcol == col)
+		return;
+	cup = ttcup(row, col);
+	best = cup != NULL ? (int)strlen(cup) : HUGE;
+	if (row == 0 && col == 0 && esc_home.e_len < best) {
+		ttescput(&esc_home, cursor_home);
 		ttrow = row;
 		ttcol = col;
+		return;
 	}
+	if (ttrow >= 0 && ttrow < nrow && ttcol >= 0 && ttcol < ncol) {
+		if (row > ttrow && ttrow <= ttbot && row > ttbot)
+			vcost = HUGE;
+		else if (row >= ttrow)
+			vcost = (row - ttrow) * esc_down.e_len;
+		else
+			vcost = (ttrow - row) * esc_up.e_len;
+		if (col >= ttcol)
+			hcost = (col - ttcol) * esc_right.e_len;
+		else
+			hcost = (ttcol - col) * esc_left.e_len;
+		crcost = esc_cr.e_len + col * esc_right.e_len;
+		if (vcost + hcost < best && hcost <= crcost) {
+			for (i = ttcol; i < col; ++i)
+				ttescput(&esc_right, cursor_right);
+			for (i = col; i < ttcol; ++i)
+				ttescput(&esc_left, cursor_left);
+		} else if (vcost + crcost < best) {
+			ttescput(&esc_cr, carriage_return);
+			for (i = 0; i < col; ++i)
+				ttescput(&esc_right, cursor_right);
+		} else
+			vcost = HUGE;
+		if (vcost < HUGE) {
+			for (i = ttrow; i < row; ++i)
+				ttescput(&esc_down, cursor_down);
+			for (i = row; i < ttrow; ++i)
+				ttescput(&esc_up, cursor_up);
+			ttrow = row;
+			ttcol = col;
+			return;
+		}
+	}
+	if (cup != NULL)
+		for (cp = cup; *cp != '\0'; ++cp)
+			ttputc(*cp);
+	else
+		putpad(tgoto(cursor_address, col, row), 1);
+	ttrow = row;
+	ttcol = col;
 }
 
 /*
@@ -196,7 +348,7 @@ tteeol(void)
 	int	i;
 
 	if (clr_eol)
-		putpad(clr_eol, 1);
+		ttescput(&esc_eol, clr_eol);
 	else {
 		i = ncol - ttcol;
 		while (i--)
@@ -399,10 +551,10 @@ ttcolor(int color)
 	if (color != tthue) {
 		if (color == CTEXT)
 			/* normal video */
-			putpad(exit_standout_mode, 1);
+			ttescput(&esc_se, exit_standout_mode);
 		else if (color == CMODE)
 			/* reverse video */
-			putpad(enter_standout_mode, 1);
+			ttescput(&esc_so, enter_standout_mode);
 		/* save the color */
 		tthue = color;
 	}
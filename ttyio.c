@@ -32,11 +32,24 @@
 
 #include "def.h"
 
-#define NOBUF	512			/* Output buffer size. */
+#ifdef  MGLOG
+#include "log.h"
+#endif
+
+#define NOBUF	4096			/* Initial output buffer size. */
+#define NOBUFMAX (1024 * 1024)		/* Flush rather than grow past. */
+#define NIBUF	8192			/* Input buffer size. */
+#define NIBACK	16			/* Characters ttungetc() can hold. */
 
 int	ttstarted;
-char	obuf[NOBUF];			/* Output buffer. */
+char	*obuf;				/* Output buffer. */
 size_t	nobuf;				/* Buffer count. */
+size_t	obufsize;			/* Buffer size. */
+char	ibuf[NIBUF];			/* Input buffer. */
+size_t	nibuf;				/* Bytes read into it. */
+size_t	ibufp;				/* Next byte to hand out. */
+char	iback[NIBACK];			/* Bytes given back, last first. */
+int	niback;				/* How many. */
 struct	termios	oldtty;			/* POSIX tty settings. */
 struct	termios	newtty;
 int	nrow;				/* Terminal size, rows. */
@@ -124,14 +137,27 @@ ttcooked(void)
 }
 
 /*
- * Write character to the display.  Characters are buffered up,
- * to make things a little bit more efficient.
+ * Write character to the display.  Characters are buffered up until
+ * the next ttflush(), and the buffer grows so that a whole redisplay
+ * goes out in a single write.
  */
 int
 ttputc(int c)
 {
-	if (nobuf >= NOBUF)
-		ttflush();
+	char	*nbuf;
+	size_t	 nsize;
+
+	if (nobuf >= obufsize) {
+		nsize = obufsize ? obufsize * 2 : NOBUF;
+		if (nsize > NOBUFMAX || (nbuf = realloc(obuf, nsize)) == NULL) {
+			if (obufsize == 0)
+				panic("out of memory in tty output");
+			ttflush();
+		} else {
+			obuf = nbuf;
+			obufsize = nsize;
+		}
+	}
 	obuf[nobuf++] = c;
 	return (c);
 }
@@ -144,11 +170,22 @@ ttflush(void)
 {
 	ssize_t	 written;
 	char	*buf = obuf;
+#ifdef  MGLOG
+	size_t	 bytes = nobuf;
+	int	 writes = 1;
+#endif
 
-	if (nobuf == 0 || batch == 1)
+	if (nobuf == 0)
+		return;
+	if (batch == 1) {
+		nobuf = 0;
 		return;
+	}
 
 	while ((written = write(fileno(stdout), buf, nobuf)) != nobuf) {
+#ifdef  MGLOG
+		writes++;
+#endif
 		if (written == -1) {
 			if (errno == EINTR)
 				continue;
@@ -158,20 +195,26 @@ ttflush(void)
 		nobuf -= written;
 	}
 	nobuf = 0;
+#ifdef  MGLOG
+	mglog_misc("ttflush: %zu bytes, %d writes\n", bytes, writes);
+#endif
 }
 
 /*
  * Read character from terminal. All 8 bits are returned, so that you
- * can use a multi-national terminal.
+ * can use a multi-national terminal.  Input is read into ibuf as much
+ * as is available at a time, so a large paste does not cost a read per
+ * byte.
  */
 int
 ttgetc(void)
 {
-	char	c;
 	ssize_t	ret;
 
-	do {
-		ret = read(STDIN_FILENO, &c, 1);
+	if (niback > 0)
+		return (CHARMASK(iback[--niback]));
+	while (ibufp == nibuf) {
+		ret = read(STDIN_FILENO, ibuf, sizeof(ibuf));
 		if (ret == -1 && errno == EINTR) {
 			if (winch_flag) {
 				redraw(0, 0);
@@ -179,20 +222,37 @@ ttgetc(void)
 			}
 		} else if (ret == -1 && errno == EIO)
 			panic("lost stdin");
-		else if (ret == 1)
-			break;
-	} while (1);
-	return ((int) c) & 0xFF;
+		else if (ret > 0) {
+			nibuf = ret;
+			ibufp = 0;
+		}
+	}
+	return ((int) ibuf[ibufp++]) & 0xFF;
 }
 
 /*
- * Returns TRUE if there are characters waiting to be read.
+ * Give back a character read by ttgetc(), to be read again before
+ * anything else.  Characters given back together come out in the
+ * opposite order.
+ */
+void
+ttungetc(int c)
+{
+	if (niback < NIBACK)
+		iback[niback++] = c;
+}
+
+/*
+ * Returns TRUE if there are characters waiting to be read, either
+ * already in ibuf or still in the terminal.
  */
 int
 charswaiting(void)
 {
 	int	x;
 
+	if (niback > 0 || ibufp != nibuf)
+		return (niback + nibuf - ibufp);
 	return ((ioctl(0, FIONREAD, &x) == -1) ? 0 : x);
 }
 
@@ -224,6 +284,8 @@ ttwait(int msec)
 {
 	struct pollfd	pfd[1];
 
+	if (niback > 0 || ibufp != nibuf)
+		return (FALSE);
 	pfd[0].fd = 0;
 	pfd[0].events = POLLIN;
 
@@ -12,10 +12,13 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <term.h>
 
 #include "def.h"
 #include "kbd.h"
+#include "key.h"
+#include "macro.h"
 
 /*
  * Get keyboard character.  Very simple if you use keymaps and keys files.
@@ -23,6 +26,23 @@
 
 char	*keystrings[] = {NULL};
 
+/*
+ * Bracketed paste.  The terminal sends pasted text between paste_start
+ * and paste_end once paste_on has been sent.  Use the extended terminfo
+ * capabilities if there are any, or the xterm sequences.  The sequences
+ * are taken out as the keyboard is read, and inpaste is TRUE while the
+ * characters read come from a paste.
+ */
+#define PASTESEQWAIT	100	/* ms to wait for the rest of a sequence */
+#define PASTEWAIT	500	/* ms to wait for more pasted text */
+
+static char	*paste_on, *paste_off, *paste_start, *paste_end;
+static int	 pastestall;	/* The paste stopped coming for a while */
+int		 inpaste;
+
+static char	*ttycap(char *, char *);
+static int	 pastegetc(int);
+
 /*
  * Turn on function keys using keypad_xmit, then load a keys file, if
  * available.  The keys file is located in the same manner as the startup
@@ -58,6 +78,11 @@ ttykeymapinit(void)
 	if (key_dc)
 		dobindkey(fundamental_map, "delete-char", key_dc);
 
+	paste_on = ttycap("BE", "\033[?2004h");
+	paste_off = ttycap("BD", "\033[?2004l");
+	paste_start = ttycap("PS", "\033[200~");
+	paste_end = ttycap("PE", "\033[201~");
+
 	if ((cp = getenv("TERM")) != NULL &&
 	    (ffp = startupfile(cp, NULL, file, sizeof(file))) != NULL) {
 		if (load(ffp, file) != TRUE)
@@ -67,6 +92,19 @@ ttykeymapinit(void)
 	if (keypad_xmit)
 		/* turn on keypad */
 		putpad(keypad_xmit, 1);
+	putpad(paste_on, 1);
+}
+
+/*
+ * Set the keyboard up again when the editor is resumed.
+ */
+void
+ttykeymapreinit(void)
+{
+	if (keypad_xmit)
+		/* turn on keypad */
+		putpad(keypad_xmit, 1);
+	putpad(paste_on, 1);
 }
 
 /*
@@ -78,4 +116,127 @@ ttykeymaptidy(void)
 	if (keypad_local)
 		/* turn off keypad */
 		putpad(keypad_local, 1);
+	putpad(paste_off, 1);
+}
+
+/*
+ * Look up a string capability that is not in the standard terminfo
+ * set, falling back to def if the terminal description lacks it.
+ */
+static char *
+ttycap(char *name, char *def)
+{
+	char	*cp;
+
+	cp = tigetstr(name);
+	if (cp == NULL || cp == (char *)-1 || *cp == '\0')
+		return (def);
+	return (cp);
+}
+
+/*
+ * Read a character from the terminal, taking out the sequences that
+ * start and end a paste.  The rest of a sequence is not waited for long,
+ * so a lone escape still gets through.  If stop is TRUE, return -1 at
+ * the end of a paste instead of reading on.
+ */
+static int
+pastegetc(int stop)
+{
+	char	*seq;
+	int	 c, i;
+
+	for (;;) {
+		c = ttgetc();
+		seq = inpaste ? paste_end : paste_start;
+		if (c != CHARMASK(seq[0]))
+			return (c);
+		for (i = 1; seq[i] != '\0'; i++) {
+			if (ttwait(PASTESEQWAIT))
+				break;
+			if ((c = ttgetc()) != CHARMASK(seq[i])) {
+				ttungetc(c);
+				break;
+			}
+		}
+		if (seq[i] == '\0') {
+			inpaste = !inpaste;
+			pastestall = FALSE;
+			if (stop && !inpaste)
+				return (-1);
+			continue;
+		}
+		while (--i > 0)
+			ttungetc(seq[i]);
+		return (CHARMASK(seq[0]));
+	}
+}
+
+/*
+ * Read a key from the terminal for getkey().  Pasted text comes through
+ * as plain characters, with inpaste set.
+ */
+int
+ttykbdgetc(void)
+{
+	return (pastegetc(FALSE));
+}
+
+/*
+ * Insert text pasted into the terminal.  doin() comes here on the first
+ * pasted character, which is in key.k_chars[], and the rest is read
+ * straight from the terminal up to the end of the paste.  The text goes
+ * in as one insertion, so it is a single undo step, and is not seen by
+ * key bindings, auto-fill or auto-indent.  If the rest of the paste is
+ * slow to come, what there is goes in and doin() comes back for more;
+ * a C-g that comes after such a wait gives up on the paste.  Any other
+ * C-g is pasted text.  Pasted text is not recorded in keyboard macros.
+ */
+int
+bpaste(int f, int n)
+{
+	char	*buf = NULL, *nbuf;
+	size_t	 len = 0, size = 0;
+	int	 c, cr = FALSE, s;
+
+	if (!inpaste || inmacro)
+		return (TRUE);
+	c = key.k_chars[key.k_count - 1];
+	while (c != -1) {
+		if (c == CCHR('G') && pastestall) {
+			/* Throw away the rest too, so it is not typed. */
+			while (c != -1 && !ttwait(PASTEWAIT))
+				c = pastegetc(TRUE);
+			inpaste = pastestall = FALSE;
+			free(buf);
+			return (ABORT);
+		}
+		if (len + 1 >= size) {
+			size = size ? size * 2 : 4096;
+			if ((nbuf = realloc(buf, size)) == NULL) {
+				free(buf);
+				return (dobeep_msg("Out of memory"));
+			}
+			buf = nbuf;
+		}
+		/* Terminals send a newline in a paste as a return. */
+		if (c == '\n' && cr)
+			cr = FALSE;
+		else {
+			if ((cr = (c == '\r')))
+				c = *curbp->b_nlchr;
+			buf[len++] = c;
+		}
+		pastestall = FALSE;
+		if (ttwait(PASTEWAIT)) {
+			pastestall = TRUE;
+			break;
+		}
+		c = pastegetc(TRUE);
+	}
+	undo_add_boundary(FFRAND, 1);
+	s = linsert_str(buf, len);
+	undo_add_boundary(FFRAND, 1);
+	free(buf);
+	return (s);
 }
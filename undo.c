@@ -4,6 +4,7 @@
  */
 
 #include <sys/queue.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +15,18 @@
 
 #define MAX_FREE_RECORDS	32
 
+/*
+ * Undo memory budget.  When a buffer's records hold more than
+ * UNDO_BUFMAX bytes, or those of all buffers more than UNDO_MAX, older
+ * records are merged and then the oldest undo groups dropped, until
+ * usage is back under three quarters of the limit.  This is done as
+ * each group is closed; a buffer whose history could not be brought
+ * under the limit is left alone until it closes another group.
+ */
+#define UNDO_BUFMAX	(8 * 1024 * 1024)
+#define UNDO_MAX	(32 * 1024 * 1024)
+#define UNDO_LOW(max)	((max) / 4 * 3)
+
 /*
  * Local variables
  */
@@ -21,6 +34,22 @@ static struct undoq		 undo_free;
 static int			 undo_free_num;
 static int			 boundary_flag = TRUE;
 static int			 undo_enable_flag = TRUE;
+static size_t			 undo_total;	/* Bytes in all buffers	 */
+static int			 undo_busy;	/* undo() is walking	 */
+static int			 undo_tag;	/* Records are undo()'s	 */
+
+/*
+ * An open bulk change: the original text of the span its edits have
+ * touched so far, which is now bulk_start up to bulk_end.
+ */
+static struct buffer		*bulk_bp;	/* Buffer being changed	 */
+static int			 bulk_depth;	/* Nested begin calls	 */
+static int			 bulk_used;	/* Any edits yet	 */
+static int			 bulk_start;	/* Span, as it is now	 */
+static int			 bulk_end;
+static char			*bulk_text;	/* Its original text	 */
+static int			 bulk_len;
+static int			 bulk_alloc;
 
 /*
  * Local functions
@@ -28,7 +57,17 @@ static int			 undo_enable_flag = TRUE;
 static int find_dot(struct line *, int);
 static int find_lo(int, struct line **, int *, int *);
 static struct undo_rec *new_undo_record(void);
-static int drop_oldest_undo_record(void);
+static size_t undo_cost(struct undo_rec *);
+static void undo_link(struct undo_rec *);
+static void undo_unlink(struct buffer *, struct undo_rec *);
+static void undo_trim(void);
+static size_t undo_shrink(struct buffer *, size_t);
+static size_t undo_compact(struct buffer *);
+static int undo_merge(struct undo_rec *, struct undo_rec *);
+static size_t undo_drop_group(struct buffer *);
+static int undo_group(struct undo_rec **);
+static int undo_bulk_add(int, int, int);
+static int undo_bulk_grab(int, int, int);
 
 /*
  * find_dot, find_lo()
@@ -36,7 +75,9 @@ static int drop_oldest_undo_record(void);
  * Find an absolute dot in the buffer from a line/offset pair, and vice-versa.
  *
  * Since lines can be deleted while they are referenced by undo record, we
- * need to have an absolute dot to have something reliable.
+ * need to have an absolute dot to have something reliable.  The buffer's
+ * position index answers in logarithmic time; the buffer is only walked
+ * if the index cannot be built.
  */
 static int
 find_dot(struct line *lp, int off)
@@ -44,6 +85,9 @@ find_dot(struct line *lp, int off)
 	int	 count = 0;
 	struct line	*p;
 
+	if (lidxpos(curbp, lp, off, &count) == TRUE)
+		return (count);
+
 	for (p = curbp->b_headp; p != lp; p = lforw(p)) {
 		if (count != 0) {
 			if (p == curbp->b_headp) {
@@ -66,6 +110,9 @@ find_lo(int pos, struct line **olp, int *offset, int *lnum)
 	struct line *p;
 	int lineno;
 
+	if (lidxfind(curbp, pos, olp, offset, lnum) == TRUE)
+		return (TRUE);
+
 	p = curbp->b_headp;
 	lineno = 0;
 	while (pos > llength(p)) {
@@ -127,22 +174,225 @@ free_undo_record(struct undo_rec *rec)
 }
 
 /*
- * Drop the oldest undo record in our list. Return 1 if we could remove it,
- * 0 if the undo list was empty.
+ * Bytes an undo record holds.
  */
-static int
-drop_oldest_undo_record(void)
+static size_t
+undo_cost(struct undo_rec *rec)
+{
+	size_t	 cost = sizeof(*rec);
+
+	if (rec->content != NULL)
+		cost += rec->region.r_size + 1;
+	return (cost);
+}
+
+/*
+ * Put "rec" at the top of the current buffer's undo list.  If it
+ * closes a group, keep the undo history within its budget.
+ */
+static void
+undo_link(struct undo_rec *rec)
+{
+	size_t	 cost = undo_cost(rec);
+
+	rec->byundo = undo_tag;
+	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	curbp->b_undosize += cost;
+	undo_total += cost;
+	if (rec->type == BOUNDARY) {
+		curbp->b_undofloor = FALSE;
+		undo_trim();
+	}
+}
+
+/*
+ * Take "rec" off the undo list of "bp" and free it.
+ */
+static void
+undo_unlink(struct buffer *bp, struct undo_rec *rec)
+{
+	size_t	 cost = undo_cost(rec);
+
+	if (bp->b_undoptr == rec)
+		bp->b_undoptr = NULL;
+	if (bp->b_redoptr == rec)
+		bp->b_redoptr = NULL;
+	TAILQ_REMOVE(&bp->b_undo, rec, next);
+	bp->b_undosize -= cost;
+	undo_total -= cost;
+	free_undo_record(rec);
+}
+
+/*
+ * Free all the undo records of "bp".
+ */
+void
+undo_clear(struct buffer *bp)
 {
 	struct undo_rec *rec;
 
-	rec = TAILQ_LAST(&curbp->b_undo, undoq);
-	if (rec != NULL) {
-		undo_free_num--;
-		TAILQ_REMOVE(&curbp->b_undo, rec, next);
-		free_undo_record(rec);
-		return (1);
+	while ((rec = TAILQ_FIRST(&bp->b_undo)) != NULL)
+		undo_unlink(bp, rec);
+	bp->b_undoptr = NULL;
+	bp->b_redoptr = NULL;
+	bp->b_undofloor = FALSE;
+}
+
+/*
+ * Bring the current buffer's undo history within UNDO_BUFMAX, then
+ * that of all buffers within UNDO_MAX, taking from the biggest first.
+ * Buffers already trimmed as far as they go are skipped.  Not while
+ * undo() is walking the list, it trims when done.
+ */
+static void
+undo_trim(void)
+{
+	struct buffer	*bp, *big;
+
+	if (undo_busy)
+		return;
+	if (curbp->b_undosize > UNDO_BUFMAX && !curbp->b_undofloor)
+		(void)undo_shrink(curbp,
+		    curbp->b_undosize - UNDO_LOW(UNDO_BUFMAX));
+	while (undo_total > UNDO_MAX) {
+		big = NULL;
+		for (bp = bheadp; bp != NULL; bp = bp->b_bufp)
+			if (!bp->b_undofloor && (big == NULL ||
+			    bp->b_undosize > big->b_undosize))
+				big = bp;
+		if (big == NULL)
+			break;
+		(void)undo_shrink(big, undo_total - UNDO_LOW(UNDO_MAX));
 	}
-	return (0);
+}
+
+/*
+ * Free at least "want" bytes of the undo history of "bp", merging
+ * records first and then dropping the oldest groups.  The newest group
+ * is always kept; if that leaves bp short, it is marked so that it is
+ * not tried again before it closes another group.  Return the bytes
+ * freed.
+ */
+static size_t
+undo_shrink(struct buffer *bp, size_t want)
+{
+	size_t	 freed, n;
+
+	freed = undo_compact(bp);
+	while (freed < want && (n = undo_drop_group(bp)) > 0)
+		freed += n;
+	if (freed < want)
+		bp->b_undofloor = TRUE;
+	return (freed);
+}
+
+/*
+ * Merge neighbouring records of the same undo group that undo can
+ * apply as one: contiguous inserts, and deletes of contiguous text.
+ * The newest group is left alone, since undo_add_delete() and
+ * undo_add_insert() still look at its records.  Return the bytes freed.
+ */
+static size_t
+undo_compact(struct buffer *bp)
+{
+	struct undo_rec *rec, *prev;
+	size_t		 before, freed = 0;
+
+	/* skip the newest group */
+	TAILQ_FOREACH(rec, &bp->b_undo, next)
+		if (rec->type == BOUNDARY)
+			break;
+	if (rec == NULL)
+		return (0);
+
+	while ((prev = rec, rec = TAILQ_NEXT(rec, next)) != NULL) {
+		if (prev->type == BOUNDARY || rec->type == BOUNDARY)
+			continue;
+		before = undo_cost(prev) + undo_cost(rec);
+		if (undo_merge(prev, rec) == FALSE)
+			continue;
+		if (bp->b_undoptr == prev)
+			bp->b_undoptr = rec;
+		if (bp->b_redoptr == prev)
+			bp->b_redoptr = rec;
+		TAILQ_REMOVE(&bp->b_undo, prev, next);
+		free_undo_record(prev);
+		bp->b_undosize -= before - undo_cost(rec);
+		undo_total -= before - undo_cost(rec);
+		freed += before - undo_cost(rec);
+	}
+	return (freed);
+}
+
+/*
+ * Fold "new" into the older record "old" when undoing the merged
+ * record has the same effect as undoing "new" and then "old".
+ */
+static int
+undo_merge(struct undo_rec *new, struct undo_rec *old)
+{
+	char	*cp;
+	int	 size;
+
+	if (new->type != old->type || new->byundo != old->byundo)
+		return (FALSE);
+	if (new->type == INSERT) {
+		if (new->pos != old->pos &&
+		    new->pos != old->pos + old->region.r_size)
+			return (FALSE);
+		old->region.r_size += new->region.r_size;
+		return (TRUE);
+	}
+	if (new->type != DELETE ||
+	    (new->pos != old->pos &&
+	    new->pos + new->region.r_size != old->pos))
+		return (FALSE);
+	if (new->region.r_size > INT_MAX - old->region.r_size)
+		return (FALSE);
+	size = old->region.r_size + new->region.r_size;
+	if ((cp = malloc(size + 1)) == NULL)
+		return (FALSE);
+	if (new->pos == old->pos) {
+		/* forward: the new text followed the old */
+		memcpy(cp, old->content, old->region.r_size);
+		memcpy(&cp[old->region.r_size], new->content,
+		    new->region.r_size);
+	} else {
+		/* backward: the new text came before the old */
+		memcpy(cp, new->content, new->region.r_size);
+		memcpy(&cp[new->region.r_size], old->content,
+		    old->region.r_size);
+		old->dotoff += new->region.r_size;
+		old->pos = new->pos;
+	}
+	free(old->content);
+	old->content = cp;
+	old->region.r_size = size;
+	return (TRUE);
+}
+
+/*
+ * Drop the oldest undo group of "bp", up to and including its
+ * boundary.  Return the bytes freed, 0 if only the newest group is
+ * left.
+ */
+static size_t
+undo_drop_group(struct buffer *bp)
+{
+	struct undo_rec *rec, *end;
+	size_t		 before = bp->b_undosize;
+
+	for (end = TAILQ_LAST(&bp->b_undo, undoq); end != NULL;
+	    end = TAILQ_PREV(end, undoq, next))
+		if (end->type == BOUNDARY)
+			break;
+	if (end == NULL || end == TAILQ_FIRST(&bp->b_undo))
+		return (0);
+	do {
+		rec = TAILQ_LAST(&bp->b_undo, undoq);
+		undo_unlink(bp, rec);
+	} while (rec != end);
+	return (before - bp->b_undosize);
 }
 
 static int
@@ -225,6 +475,8 @@ undo_add_boundary(int f, int n)
 
 	if (boundary_flag == FALSE)
 		return (FALSE);
+	if (bulk_depth > 0 && curbp == bulk_bp)
+		return (TRUE);
 
 	last = lastrectype();
 	if (last == BOUNDARY || last == MODIFIED)
@@ -233,7 +485,7 @@ undo_add_boundary(int f, int n)
 	rec = new_undo_record();
 	rec->type = BOUNDARY;
 
-	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	undo_link(rec);
 
 	return (TRUE);
 }
@@ -251,15 +503,13 @@ undo_add_modified(void)
 #else
 	TAILQ_FOREACH_SAFE(rec, &curbp->b_undo, next, trec)
 #endif
-		if (rec->type == MODIFIED) {
-			TAILQ_REMOVE(&curbp->b_undo, rec, next);
-			free_undo_record(rec);
-		}
+		if (rec->type == MODIFIED)
+			undo_unlink(curbp, rec);
 
 	rec = new_undo_record();
 	rec->type = MODIFIED;
 
-	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	undo_link(rec);
 
 	return;
 }
@@ -281,6 +531,9 @@ undo_add_insert(struct line *lp, int offset, int size)
 
 	pos = find_dot(lp, offset);
 
+	if (bulk_depth > 0 && curbp == bulk_bp)
+		return (undo_bulk_add(pos, size, TRUE));
+
 	/*
 	 * We try to reuse the last undo record to `compress' things.
 	 */
@@ -303,7 +556,7 @@ undo_add_insert(struct line *lp, int offset, int size)
 
 	undo_add_boundary(FFRAND, 1);
 
-	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	undo_link(rec);
 
 	return (TRUE);
 }
@@ -328,6 +581,9 @@ undo_add_delete(struct line *lp, int offset, int size, int isreg)
 
 	pos = find_dot(lp, offset);
 
+	if (bulk_depth > 0 && curbp == bulk_bp)
+		return (undo_bulk_add(pos, size, FALSE));
+
 	if (offset == llength(lp))	/* if it's a newline... */
 		undo_add_boundary(FFRAND, 1);
 	else if ((rec = TAILQ_FIRST(&curbp->b_undo)) != NULL) {
@@ -349,7 +605,8 @@ undo_add_delete(struct line *lp, int offset, int size, int isreg)
 	memmove(&rec->region, &reg, sizeof(struct region));
 	do {
 		rec->content = malloc(reg.r_size + 1);
-	} while ((rec->content == NULL) && drop_oldest_undo_record());
+	} while (rec->content == NULL && !undo_busy &&
+	    undo_drop_group(curbp) > 0);
 
 	if (rec->content == NULL)
 		panic("Out of memory");
@@ -359,7 +616,7 @@ undo_add_delete(struct line *lp, int offset, int size, int isreg)
 	if (isreg || lastrectype() != DELETE)
 		undo_add_boundary(FFRAND, 1);
 
-	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	undo_link(rec);
 
 	return (TRUE);
 }
@@ -382,6 +639,137 @@ undo_add_change(struct line *lp, int offset, int size)
 	return (TRUE);
 }
 
+/*
+ * Start a bulk change in the current buffer.  Until the matching
+ * undo_bulk_end(), its edits are not recorded one by one: the original
+ * text of the span they touch is kept instead, and becomes a single
+ * BULK record, undone in one step however many edits there were.
+ * Calls may nest.
+ */
+void
+undo_bulk_begin(void)
+{
+	if (bulk_depth++ > 0)
+		return;
+	bulk_bp = curbp;
+	bulk_used = FALSE;
+	bulk_len = 0;
+}
+
+/*
+ * End a bulk change, recording it if it changed anything.
+ */
+void
+undo_bulk_end(void)
+{
+	struct undo_rec	*rec;
+	struct buffer	*bp;
+
+	if (bulk_depth == 0 || --bulk_depth > 0)
+		return;
+	bp = curbp;
+	curbp = bulk_bp;
+	if (bulk_used) {
+		rec = new_undo_record();
+		rec->type = BULK;
+		rec->pos = bulk_start;
+		rec->newsize = bulk_end - bulk_start;
+		rec->region.r_size = bulk_len;
+		if ((rec->content = malloc(bulk_len + 1)) == NULL)
+			panic("Out of memory in undo code (bulk)");
+		memcpy(rec->content, bulk_text, bulk_len);
+		rec->content[bulk_len] = '\0';
+		undo_add_boundary(FFRAND, 1);
+		undo_link(rec);
+		undo_add_boundary(FFRAND, 1);
+	}
+	curbp = bp;
+	bulk_bp = NULL;
+	if (bulk_alloc > 1024 * 1024) {
+		free(bulk_text);
+		bulk_text = NULL;
+		bulk_alloc = 0;
+	}
+}
+
+/*
+ * Take an edit of the open bulk change: "size" bytes inserted at "pos"
+ * (already done), or about to be deleted there.  Text the span does not
+ * cover yet is still the original, so it is copied in as the span
+ * grows to take in the edit.
+ */
+static int
+undo_bulk_add(int pos, int size, int insert)
+{
+	int	 got;
+
+	if (!bulk_used) {
+		bulk_start = bulk_end = pos;
+		bulk_used = TRUE;
+	}
+	if (pos < bulk_start) {
+		/* an insert has pushed the span along already */
+		(void)undo_bulk_grab(insert ? pos + size : pos, bulk_start - pos,
+		    TRUE);
+		bulk_start = pos;
+	}
+	if (insert) {
+		if (pos > bulk_end) {
+			(void)undo_bulk_grab(bulk_end, pos - bulk_end, FALSE);
+			bulk_end = pos;
+		}
+		bulk_end += size;
+	} else {
+		if (pos + size > bulk_end) {
+			got = undo_bulk_grab(bulk_end, pos + size - bulk_end,
+			    FALSE);
+			bulk_end += got;
+		}
+		bulk_end -= size < bulk_end - pos ? size : bulk_end - pos;
+	}
+	return (TRUE);
+}
+
+/*
+ * Copy "len" bytes of the buffer from "pos" to the front or the back of
+ * the bulk change's text.  Return how many there were.
+ */
+static int
+undo_bulk_grab(int pos, int len, int front)
+{
+	struct region	 reg;
+	char		*nt;
+	int		 nalloc, got;
+
+	if (len <= 0)
+		return (0);
+	if (bulk_len + len + 1 > bulk_alloc) {
+		nalloc = bulk_alloc ? bulk_alloc : 4096;
+		while (nalloc < bulk_len + len + 1) {
+			if (nalloc > INT_MAX / 2)
+				panic("Bulk change too large for undo");
+			nalloc *= 2;
+		}
+		if ((nt = realloc(bulk_text, nalloc)) == NULL)
+			panic("Out of memory in undo code (bulk)");
+		bulk_text = nt;
+		bulk_alloc = nalloc;
+	}
+	memset(&reg, 0, sizeof(reg));
+	if (find_lo(pos, &reg.r_linep, &reg.r_offset, &reg.r_lineno) == FALSE)
+		return (0);
+	if (front) {
+		memmove(&bulk_text[len], bulk_text, bulk_len);
+		got = region_get_data(&reg, bulk_text, len);
+		/* the front is always whole: it lies before the span */
+		bulk_len += len;
+	} else {
+		got = region_get_data(&reg, &bulk_text[bulk_len], len);
+		bulk_len += got;
+	}
+	return (got);
+}
+
 /*
  * Show the undo records for the current buffer in a new buffer.
  */
@@ -411,6 +799,10 @@ undo_dump(int f, int n)
 		}
 	}
 
+	addlinef(bp, "Undo memory: %zu bytes in %s (limit %d), "
+	    "%zu in all buffers (limit %d)", curbp->b_undosize,
+	    curbp->b_bname, UNDO_BUFMAX, undo_total, UNDO_MAX);
+
 	num = 0;
 	TAILQ_FOREACH(rec, &curbp->b_undo, next) {
 		num++;
@@ -420,7 +812,8 @@ undo_dump(int f, int n)
 		    (rec->type == DELREG) ? "DELREGION":
 		    (rec->type == INSERT) ? "INSERT":
 		    (rec->type == BOUNDARY) ? "----" :
-		    (rec->type == MODIFIED) ? "MODIFIED": "UNKNOWN",
+		    (rec->type == MODIFIED) ? "MODIFIED":
+		    (rec->type == BULK) ? "BULK" : "UNKNOWN",
 		    rec->pos);
 
 		if (rec->content) {
@@ -440,7 +833,7 @@ undo_dump(int f, int n)
 	}
 	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
 		if (wp->w_bufp == bp) {
-			wp->w_dotline = num+1;
+			wp->w_dotline = num+2;
 			wp->w_rflag |= WFFULL;
 		}
 	}
@@ -486,11 +879,8 @@ int
 undo(int f, int n)
 {
 	struct undo_rec	*ptr, *nptr;
-	int		 done, rval;
-	struct line	*lp;
-	int		 offset, save;
+	int		 rval;
 	static int	 nulled = FALSE;
-	int		 lineno;
 
 	if (n < 0)
 		return (FALSE);
@@ -504,12 +894,13 @@ undo(int f, int n)
 	}
 
 	rval = TRUE;
+	undo_busy = 1;
+	undo_tag = 1;
 	while (n--) {
 		/* if we have a spurious boundary, free it and move on.... */
 		while (ptr && ptr->type == BOUNDARY) {
 			nptr = TAILQ_NEXT(ptr, next);
-			TAILQ_REMOVE(&curbp->b_undo, ptr, next);
-			free_undo_record(ptr);
+			undo_unlink(curbp, ptr);
 			ptr = nptr;
 		}
 		/*
@@ -526,79 +917,156 @@ undo(int f, int n)
 		}
 		nulled = FALSE;
 
-		/*
-		 * Loop while we don't get a boundary specifying we've
-		 * finished the current action...
-		 */
+		if ((rval = undo_group(&ptr)) == FALSE)
+			break;
+		ewprintf("Undo!");
+	}
+	undo_tag = 0;
+	undo_busy = 0;
+	curbp->b_undoptr = ptr;
+	undo_trim();
 
-		undo_add_boundary(FFRAND, 1);
+	return (rval);
+}
+
+/*
+ * Undo the last undo.  The groups undo() put at the top of the list are
+ * undone in turn, newest first, as long as this is invoked again without
+ * an intervening command; anything else stops it.  What it does is
+ * recorded like any other change, so undo takes it back.
+ */
+int
+undo_redo(int f, int n)
+{
+	struct undo_rec	*ptr;
+	int		 rval;
+
+	if (n < 0)
+		return (FALSE);
+
+	ptr = curbp->b_redoptr;
+	if (rptcount == 0)
+		ptr = TAILQ_FIRST(&curbp->b_undo);
+
+	rval = TRUE;
+	undo_busy = 1;
+	while (n--) {
+		while (ptr && ptr->type == BOUNDARY)
+			ptr = TAILQ_NEXT(ptr, next);
+		if (ptr == NULL || !ptr->byundo) {
+			dobeep();
+			ewprintf("No further redo information");
+			rval = FALSE;
+			break;
+		}
+		if ((rval = undo_group(&ptr)) == FALSE)
+			break;
+		ewprintf("Redo!");
+	}
+	undo_busy = 0;
+	curbp->b_redoptr = ptr;
+	undo_trim();
+
+	return (rval);
+}
+
+/*
+ * Apply the inverse of the undo group at "*ptrp", recording it as a
+ * new group at the top of the list, and leave "*ptrp" at the record
+ * after the group's boundary.
+ *
+ * Boundaries (and the modified flag) are put as position 0 (to save
+ * lookup time in find_dot) so we must not move there.  The others are
+ * found through the buffer's position index, so each step costs the
+ * same however far back it goes.
+ */
+static int
+undo_group(struct undo_rec **ptrp)
+{
+	struct undo_rec	*ptr = *ptrp;
+	struct line	*lp;
+	int		 offset, lineno, save, done, rval;
 
-		save = boundary_flag;
-		boundary_flag = FALSE;
-
-		done = 0;
-		do {
-			/*
-			 * Move to where this has to apply
-			 *
-			 * Boundaries (and the modified flag)  are put as
-			 * position 0 (to save lookup time in find_dot)
-			 * so we must not move there...
-			 */
-			if (ptr->type != BOUNDARY && ptr->type != MODIFIED) {
-				if (find_lo(ptr->pos, &lp,
-				    &offset, &lineno) == FALSE) {
-					dobeep();
-					ewprintf("Internal error in Undo!");
-					rval = FALSE;
-					break;
-				}
-				curwp->w_dotp = lp;
-				curwp->w_doto = offset;
-				curwp->w_markline = curwp->w_dotline;
-				curwp->w_dotline = lineno;
+	/*
+	 * Loop while we don't get a boundary specifying we've
+	 * finished the current action...
+	 */
+	undo_add_boundary(FFRAND, 1);
+
+	save = boundary_flag;
+	boundary_flag = FALSE;
+
+	rval = TRUE;
+	done = 0;
+	do {
+		/* Move to where this has to apply */
+		if (ptr->type != BOUNDARY && ptr->type != MODIFIED) {
+			if (find_lo(ptr->pos, &lp, &offset, &lineno) == FALSE) {
+				dobeep();
+				ewprintf("Internal error in Undo!");
+				rval = FALSE;
+				break;
 			}
+			curwp->w_dotp = lp;
+			curwp->w_doto = offset;
+			curwp->w_markline = curwp->w_dotline;
+			curwp->w_dotline = lineno;
+		}
 
-			/*
-			 * Do operation^-1
-			 */
-			switch (ptr->type) {
-			case INSERT:
-				ldelete(ptr->region.r_size, KNONE);
+		/*
+		 * Do operation^-1
+		 */
+		switch (ptr->type) {
+		case INSERT:
+			ldelete(ptr->region.r_size, KNONE);
+			break;
+		case DELETE:
+			lp = curwp->w_dotp;
+			offset = curwp->w_doto;
+			region_put_data(ptr->content, ptr->region.r_size);
+			/* merged deletes leave dot further on */
+			if (ptr->dotoff != 0 && find_lo(ptr->pos +
+			    ptr->dotoff, &lp, &offset, &lineno) == FALSE)
 				break;
-			case DELETE:
-				lp = curwp->w_dotp;
-				offset = curwp->w_doto;
-				region_put_data(ptr->content,
-				    ptr->region.r_size);
-				curwp->w_dotp = lp;
-				curwp->w_doto = offset;
+			curwp->w_dotp = lp;
+			curwp->w_doto = offset;
+			curwp->w_dotline = lineno;
+			break;
+		case DELREG:
+			region_put_data(ptr->content, ptr->region.r_size);
+			break;
+		case BULK:
+			if (ptr->newsize > 0 &&
+			    ldelete(ptr->newsize, KNONE) == FALSE) {
+				rval = FALSE;
 				break;
-			case DELREG:
-				region_put_data(ptr->content,
+			}
+			if (ptr->region.r_size > 0)
+				(void)linsert_str(ptr->content,
 				    ptr->region.r_size);
+			if (find_lo(ptr->pos, &lp, &offset, &lineno) == FALSE)
 				break;
-			case BOUNDARY:
-				done = 1;
-				break;
-			case MODIFIED:
-				curbp->b_flag &= ~BFCHG;
-				break;
-			default:
-				break;
-			}
-
-			/* And move to next record */
-			ptr = TAILQ_NEXT(ptr, next);
-		} while (ptr != NULL && !done);
-
-		boundary_flag = save;
-		undo_add_boundary(FFRAND, 1);
+			curwp->w_dotp = lp;
+			curwp->w_doto = offset;
+			curwp->w_dotline = lineno;
+			break;
+		case BOUNDARY:
+			done = 1;
+			break;
+		case MODIFIED:
+			curbp->b_flag &= ~BFCHG;
+			break;
+		default:
+			break;
+		}
 
-		ewprintf("Undo!");
-	}
+		/* And move to next record */
+		ptr = TAILQ_NEXT(ptr, next);
+	} while (ptr != NULL && !done);
 
-	curbp->b_undoptr = ptr;
+	boundary_flag = save;
+	undo_add_boundary(FFRAND, 1);
 
+	*ptrp = ptr;
 	return (rval);
 }
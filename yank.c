@@ -7,6 +7,7 @@
  */
 
 #include <sys/queue.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,35 +15,196 @@
 
 #include "def.h"
 
-#define KBLOCK	 8192		/* Kill grow.                    */
+#define KBLOCK	 8192		/* Least kill grow.              */
+#define KRINGLEN 60		/* Default kill ring length.	 */
+#define KRINGBYTES (16 * 1024 * 1024)	/* Most bytes kept in the ring. */
 
+/*
+ * The kill buffer is a deque: the text lies in kbufp[kstart] up to
+ * kbufp[kused], with free space on both sides, so kills in either
+ * direction add to it in place.  When one side runs out of room the
+ * buffer at least doubles, the new space going on that side.
+ */
 static char	*kbufp = NULL;	/* Kill buffer data.		 */
 static RSIZE	 kused = 0;	/* # of bytes used in KB.	 */
 static RSIZE	 ksize = 0;	/* # of bytes allocated in KB.	 */
 static RSIZE	 kstart = 0;	/* # of first used byte in KB.	 */
 
-static int	 kgrow(int);
+/*
+ * Older kills are kept in the kill ring, newest first.  Their text
+ * never changes once it is there, so a kill of the same text as one
+ * already in the ring shares it rather than keeping a second copy.
+ * The oldest kills are dropped once the ring holds more than
+ * KRINGBYTES of text, but the newest is always kept.
+ */
+struct ktext {
+	char	*kt_text;		/* Text of the kill.		 */
+	RSIZE	 kt_len;		/* # of bytes in it.		 */
+	int	 kt_refs;		/* # of ring slots using it.	 */
+};
+
+static struct ktext **kring = NULL;	/* Ring slots, newest first.	 */
+static int	 kringcnt = 0;		/* # of slots in use.		 */
+static int	 kringalloc = 0;	/* # of slots allocated.	 */
+static int	 kringlen = KRINGLEN;	/* Most slots to use.		 */
+static RSIZE	 kringbytes = 0;	/* Text held by the ring.	 */
+static int	 kyankp = 0;		/* Kill yanked last, 0 newest.	 */
+static RSIZE	 kyanklen = 0;		/* # of bytes it put in, all copies. */
+
+static int	 kgrow(int, RSIZE);
+static void	 kseal(void);
+static void	 kpush(struct ktext *);
+static void	 kdrop(void);
+static const char *kentry(int, RSIZE *);
+static int	 kentries(void);
 
 /*
- * Delete all of the text saved in the kill buffer.  Called by commands when
- * a new kill context is created. The kill buffer array is released, just in
- * case the buffer has grown to an immense size.  No errors.
+ * Start a new kill.  Called by commands when a new kill context is
+ * created.  The current kill goes into the kill ring and the kill
+ * buffer is released, just in case it has grown to an immense size.
+ * No errors.
  */
 void
 kdelete(void)
 {
 	if (kbufp != NULL) {
+		kseal();
 		free(kbufp);
 		kbufp = NULL;
 		kstart = kused = ksize = 0;
 	}
+	kyankp = 0;
+}
+
+/*
+ * Move the text in the kill buffer into the kill ring.  If the ring
+ * already has the same text it is shared, otherwise the kill buffer is
+ * trimmed and handed over as it is.  Out of memory, the kill is lost.
+ */
+static void
+kseal(void)
+{
+	struct ktext	*kt;
+	RSIZE		 len;
+	char		*nbufp;
+	int		 i;
+
+	if ((len = kused - kstart) == 0)
+		return;
+	for (i = 0; i < kringcnt; i++) {
+		kt = kring[i];
+		if (kt->kt_len == len &&
+		    memcmp(kt->kt_text, &kbufp[kstart], len) == 0) {
+			kt->kt_refs++;
+			kpush(kt);
+			return;
+		}
+	}
+	if ((kt = malloc(sizeof(*kt))) == NULL)
+		return;
+	if (kstart > 0)
+		memmove(kbufp, &kbufp[kstart], len);
+	if ((nbufp = realloc(kbufp, len)) != NULL)
+		kbufp = nbufp;
+	kt->kt_text = kbufp;
+	kt->kt_len = len;
+	kt->kt_refs = 1;
+	kringbytes += len;
+	kbufp = NULL;
+	kpush(kt);
+}
+
+/*
+ * Put "kt" in the newest slot of the kill ring, then drop the oldest
+ * kills until the ring is within its length and KRINGBYTES.
+ */
+static void
+kpush(struct ktext *kt)
+{
+	struct ktext	**nring;
+	int		  nalloc;
+
+	while (kringcnt >= kringlen)
+		kdrop();
+	if (kringcnt == kringalloc) {
+		nalloc = kringalloc ? kringalloc * 2 : 8;
+		if (nalloc > kringlen)
+			nalloc = kringlen;
+		if ((nring = reallocarray(kring, nalloc,
+		    sizeof(*nring))) != NULL) {
+			kring = nring;
+			kringalloc = nalloc;
+		} else
+			kdrop();
+	}
+	if (kringcnt == kringalloc) {
+		/* no slot at all: forget it */
+		if (--kt->kt_refs == 0) {
+			kringbytes -= kt->kt_len;
+			free(kt->kt_text);
+			free(kt);
+		}
+		return;
+	}
+	memmove(&kring[1], &kring[0], kringcnt * sizeof(*kring));
+	kring[0] = kt;
+	kringcnt++;
+	while (kringcnt > 1 && kringbytes > KRINGBYTES)
+		kdrop();
+}
+
+/*
+ * Drop the oldest kill in the kill ring, freeing its text when no
+ * other slot shares it.
+ */
+static void
+kdrop(void)
+{
+	struct ktext	*kt;
+
+	if (kringcnt == 0)
+		return;
+	kt = kring[--kringcnt];
+	if (--kt->kt_refs == 0) {
+		kringbytes -= kt->kt_len;
+		free(kt->kt_text);
+		free(kt);
+	}
+}
+
+/*
+ * Return the text of kill "n", 0 being the newest, and its length in
+ * "lenp".  The kill being built, if any, comes before the ring.  NULL
+ * if there are not that many kills.
+ */
+static const char *
+kentry(int n, RSIZE *lenp)
+{
+	if (kused > kstart) {
+		if (n == 0) {
+			*lenp = kused - kstart;
+			return (&kbufp[kstart]);
+		}
+		n--;
+	}
+	if (n < 0 || n >= kringcnt)
+		return (NULL);
+	*lenp = kring[n]->kt_len;
+	return (kring[n]->kt_text);
+}
+
+/*
+ * Number of kills there are to yank.
+ */
+static int
+kentries(void)
+{
+	return (kringcnt + (kused > kstart));
 }
 
 /*
  * Insert a character to the kill buffer, enlarging the buffer if there
- * isn't any room. Always grow the buffer in chunks, on the assumption
- * that if you put something in the kill buffer you are going to put more
- * stuff there too later. Return TRUE if all is well, and FALSE on errors.
+ * isn't any room. Return TRUE if all is well, and FALSE on errors.
  * Print a message on errors.  Dir says whether to put it at back or front.
  * This call is ignored if  KNONE is set.
  */
@@ -51,9 +213,10 @@ kinsert(int c, int dir)
 {
 	if (dir == KNONE)
 		return (TRUE);
-	if (kused == ksize && dir == KFORW && kgrow(dir) == FALSE)
+	kyankp = 0;
+	if (kused == ksize && dir == KFORW && kgrow(dir, 1) == FALSE)
 		return (FALSE);
-	if (kstart == 0 && dir == KBACK && kgrow(dir) == FALSE)
+	if (kstart == 0 && dir == KBACK && kgrow(dir, 1) == FALSE)
 		return (FALSE);
 	if (dir == KFORW)
 		kbufp[kused++] = c;
@@ -65,33 +228,36 @@ kinsert(int c, int dir)
 }
 
 /*
- * kgrow - just get more kill buffer for the callee. If dir = KBACK
- * we are trying to get space at the beginning of the kill buffer.
+ * kgrow - get room for at least "n" more bytes at the end of the kill
+ * buffer (dir = KFORW) or at the beginning (dir = KBACK).
  */
 static int
-kgrow(int dir)
+kgrow(int dir, RSIZE n)
 {
-	int	 nstart;
+	RSIZE	 grow, nsize;
 	char	*nbufp;
 
-	if ((unsigned)(ksize + KBLOCK) <= (unsigned)ksize) {
-		/* probably 16 bit unsigned */
+	grow = ksize > n ? ksize : n;
+	if (grow < KBLOCK)
+		grow = KBLOCK;
+	if (grow > INT_MAX - ksize) {
 		dobeep();
 		ewprintf("Kill buffer size at maximum");
 		return (FALSE);
 	}
-	if ((nbufp = malloc((unsigned)(ksize + KBLOCK))) == NULL) {
+	nsize = ksize + grow;
+	if ((nbufp = realloc(kbufp, nsize)) == NULL) {
 		dobeep();
-		ewprintf("Can't get %ld bytes", (long)(ksize + KBLOCK));
+		ewprintf("Can't get %ld bytes", (long)nsize);
 		return (FALSE);
 	}
-	nstart = (dir == KBACK) ? (kstart + KBLOCK) : (KBLOCK / 4);
-	bcopy(&(kbufp[kstart]), &(nbufp[nstart]), (int)(kused - kstart));
-	free(kbufp);
 	kbufp = nbufp;
-	ksize += KBLOCK;
-	kused = kused - kstart + nstart;
-	kstart = nstart;
+	if (dir == KBACK) {
+		memmove(&kbufp[kstart + grow], &kbufp[kstart], kused - kstart);
+		kstart += grow;
+		kused += grow;
+	}
+	ksize = nsize;
 	return (TRUE);
 }
 
@@ -103,9 +269,12 @@ kgrow(int dir)
 int
 kremove(int n)
 {
-	if (n < 0 || n + kstart >= kused)
+	const char	*cp;
+	RSIZE		 len;
+
+	if (n < 0 || (cp = kentry(0, &len)) == NULL || n >= len)
 		return (-1);
-	return (CHARMASK(kbufp[n + kstart]));
+	return (CHARMASK(cp[n]));
 }
 
 /*
@@ -114,6 +283,25 @@ kremove(int n)
  */
 int
 kchunk(char *cp1, RSIZE chunk, int kflag)
+{
+	char	*cp;
+
+	if (chunk == 0 || (kflag & (KFORW | KBACK)) == 0)
+		return (TRUE);
+	if ((cp = kreserve(chunk, kflag)) == NULL)
+		return (FALSE);
+	bcopy(cp1, cp, (int)chunk);
+	return (TRUE);
+}
+
+/*
+ * Make room for "chunk" bytes at the end of the kill buffer (KFORW) or
+ * at its beginning (KBACK), and return where they go, so the caller can
+ * put them there in order.  NULL if kflag has neither or there is no
+ * memory.
+ */
+char *
+kreserve(RSIZE chunk, int kflag)
 {
 	/*
 	 * HACK - doesn't matter, and fixes back-over-nl bug for empty
@@ -122,21 +310,33 @@ kchunk(char *cp1, RSIZE chunk, int kflag)
 	if (kused == kstart)
 		kflag = KFORW;
 
+	kyankp = 0;
 	if (kflag & KFORW) {
-		while (ksize - kused < chunk)
-			if (kgrow(kflag) == FALSE)
-				return (FALSE);
-		bcopy(cp1, &(kbufp[kused]), (int)chunk);
+		if (ksize - kused < chunk && kgrow(KFORW, chunk) == FALSE)
+			return (NULL);
 		kused += chunk;
+		return (&kbufp[kused - chunk]);
 	} else if (kflag & KBACK) {
-		while (kstart < chunk)
-			if (kgrow(kflag) == FALSE)
-				return (FALSE);
-		bcopy(cp1, &(kbufp[kstart - chunk]), (int)chunk);
+		if (kstart < chunk && kgrow(KBACK, chunk) == FALSE)
+			return (NULL);
 		kstart -= chunk;
+		return (&kbufp[kstart]);
 	}
+	return (NULL);
+}
 
-	return (TRUE);
+/*
+ * Give back the "chunk" bytes kreserve() just made room for.
+ */
+void
+kunreserve(RSIZE chunk, int kflag)
+{
+	if (kused - kstart == chunk)
+		kused = kstart;
+	else if (kflag & KFORW)
+		kused -= chunk;
+	else if (kflag & KBACK)
+		kstart += chunk;
 }
 
 /*
@@ -210,43 +410,43 @@ done:
 }
 
 /*
- * Yank text back from the kill buffer.  This is really easy.  All of the work
- * is done by the standard insert routines.  All you do is run the loop, and
- * check for errors.  The blank lines are inserted with a call to "newline"
- * instead of a call to "lnewline" so that the magic stuff that happens when
- * you type a carriage return also happens when a carriage return is yanked
- * back from the kill buffer.  An attempt has been made to fix the cosmetic
- * bug associated with a yank when dot is on the top line of the window
- * (nothing moves, because all of the new text landed off screen).
+ * Yank text back from the kill ring.  This is really easy.  All of the work
+ * is done by linsert_str(), which puts the whole kill in at once.  The kill
+ * yanked is the newest one, unless yank-pop has since picked another.
+ * An attempt has been made to fix the cosmetic bug associated with a yank
+ * when dot is on the top line of the window (nothing moves, because all of
+ * the new text landed off screen).
  */
 int
 yank(int f, int n)
 {
 	struct line	*lp;
-	int	 c, i, nline;
+	const char	*kp, *cp, *end;
+	RSIZE		 len;
+	int		 nline;
 
 	if (n < 0)
 		return (FALSE);
 
 	/* newline counting */
 	nline = 0;
+	kyanklen = 0;
+	if ((kp = kentry(kyankp, &len)) == NULL)
+		len = 0;
 
 	undo_boundary_enable(FFRAND, 0);
 	while (n--) {
 		/* mark around last yank */
 		isetmark();
-		i = 0;
-		while ((c = kremove(i)) >= 0) {
-			if (c == *curbp->b_nlchr) {
-				if (enewline(FFRAND, 1) == FALSE)
-					return (FALSE);
-				++nline;
-			} else {
-				if (linsert(1, c) == FALSE)
-					return (FALSE);
-			}
-			++i;
-		}
+		if (len == 0)
+			continue;
+		if (linsert_str(kp, (int)len) == FALSE)
+			return (FALSE);
+		kyanklen += len;
+		end = &kp[len];
+		for (cp = kp; (cp = memchr(cp, *curbp->b_nlchr,
+		    end - cp)) != NULL; cp++)
+			++nline;
 	}
 	/* cosmetic adjustment */
 	lp = curwp->w_linep;
@@ -260,6 +460,75 @@ yank(int f, int n)
 		curwp->w_rflag |= WFFULL;
 	}
 	undo_boundary_enable(FFRAND, 1);
+	if (!(f & FFRAND))
+		thisflag |= CFYANK;
 	return (TRUE);
 }
 
+/*
+ * Replace the text of the last yank with an older kill.  With an
+ * argument, go that many kills back around the ring, or forward if
+ * negative.  Only valid right after a yank or yank-pop, when dot is
+ * still at the end of the yanked text; all the copies a repeated yank
+ * put in are taken out.
+ */
+int
+yankpop(int f, int n)
+{
+	int	 cnt, s;
+
+	if ((lastflag & CFYANK) == 0)
+		return (dobeep_msg("Previous command was not a yank"));
+	if ((cnt = kentries()) == 0)
+		return (dobeep_msg("Kill ring is empty"));
+	kyankp = ((kyankp + n) % cnt + cnt) % cnt;
+
+	undo_boundary_enable(FFRAND, 0);
+	if (kyanklen > 0 && (backchar(FFRAND, (int)kyanklen) == FALSE ||
+	    ldelete(kyanklen, KNONE) == FALSE)) {
+		undo_boundary_enable(FFRAND, 1);
+		return (FALSE);
+	}
+	s = yank(FFRAND, 1);
+	undo_boundary_enable(FFRAND, 1);
+	if (s == TRUE)
+		thisflag |= CFYANK;
+	return (s);
+}
+
+/*
+ * Set the number of kills the kill ring keeps.
+ */
+int
+setkillringlen(int f, int n)
+{
+	char	 buf[32], *rep;
+	const char *es;
+	int	 nlen;
+
+	if ((f & FFARG) != 0) {
+		nlen = n;
+	} else {
+		if ((rep = eread("Set kill-ring-length: ", buf, sizeof(buf),
+		    EFNEW | EFCR)) == NULL)
+			return (ABORT);
+		else if (rep[0] == '\0')
+			return (FALSE);
+		nlen = strtonum(rep, 1, INT_MAX, &es);
+		if (es != NULL) {
+			dobeep();
+			ewprintf("Invalid kill ring length: %s", rep);
+			return (FALSE);
+		}
+	}
+	if (nlen < 1)
+		return (FALSE);
+	kringlen = nlen;
+	while (kringcnt > kringlen)
+		kdrop();
+	if (kyankp >= kentries())
+		kyankp = 0;
+	if (!(f & FFARG))
+		ewprintf("Kill ring length set to %d", kringlen);
+	return (TRUE);
+}